@@ -0,0 +1,147 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+// Open addressing (linear probing) hash map keyed by address
+// 0 and 1 are reserved as the empty and deleted markers, which
+// no code or object address will ever be
+template <typename V>
+class AddressMap
+{
+public:
+	AddressMap() = default;
+	AddressMap(const AddressMap &) = delete;
+	AddressMap(AddressMap &&) = delete;
+
+	~AddressMap()
+	{
+		delete[] m_Slots;
+	}
+
+	V *Find(uintptr_t key) const
+	{
+		Slot *slot = FindSlot(key);
+		return slot ? &slot->value : nullptr;
+	}
+
+	// Inserts or overwrites
+	V &Insert(uintptr_t key, const V &value)
+	{
+		if (V *existing = Find(key))
+			return *existing = value;
+
+		// Tombstones count against the load factor, otherwise
+		// a churning map could fill up with them and never terminate a probe
+		if ((m_Used + 1) * 4 > m_Capacity * 3)
+			Rehash(m_Size * 2 >= m_Capacity / 2 ? m_Capacity * 2 : m_Capacity);
+
+		for (size_t i = Hash(key) & (m_Capacity - 1);; i = (i + 1) & (m_Capacity - 1))
+		{
+			Slot &slot = m_Slots[i];
+			if (slot.key == EMPTY || slot.key == DELETED)
+			{
+				if (slot.key == EMPTY)
+					m_Used++;
+				m_Size++;
+				slot.key = key;
+				return slot.value = value;
+			}
+		}
+	}
+
+	bool Remove(uintptr_t key)
+	{
+		Slot *slot = FindSlot(key);
+		if (!slot)
+			return false;
+
+		slot->key = DELETED;
+		slot->value = V();
+		m_Size--;
+		return true;
+	}
+
+	void Clear()
+	{
+		delete[] m_Slots;
+		m_Slots = nullptr;
+		m_Capacity = m_Size = m_Used = 0;
+	}
+
+	size_t Size() const
+	{
+		return m_Size;
+	}
+
+	// f(uintptr_t key, V &value)
+	// Don't insert or remove while iterating
+	template <typename F>
+	void ForEach(F f)
+	{
+		for (size_t i = 0; i < m_Capacity; i++)
+		{
+			if (m_Slots[i].key != EMPTY && m_Slots[i].key != DELETED)
+				f(m_Slots[i].key, m_Slots[i].value);
+		}
+	}
+
+private:
+	static constexpr uintptr_t EMPTY = 0;
+	static constexpr uintptr_t DELETED = 1;
+	static constexpr size_t MIN_CAPACITY = 16;
+
+	struct Slot
+	{
+		uintptr_t key = EMPTY;
+		V value = V();
+	};
+
+	static size_t Hash(uintptr_t key)
+	{
+		// Code and heap addresses share their low bits, so mix before masking
+		uint64_t h = (uint64_t)key * 0x9E3779B97F4A7C15ull;
+		return (size_t)(h >> 32) ^ (size_t)h;
+	}
+
+	Slot *FindSlot(uintptr_t key) const
+	{
+		if (!m_Size)
+			return nullptr;
+
+		for (size_t i = Hash(key) & (m_Capacity - 1);; i = (i + 1) & (m_Capacity - 1))
+		{
+			Slot &slot = m_Slots[i];
+			if (slot.key == key)
+				return &slot;
+			if (slot.key == EMPTY)
+				return nullptr;
+		}
+	}
+
+	void Rehash(size_t capacity)
+	{
+		if (capacity < MIN_CAPACITY)
+			capacity = MIN_CAPACITY;
+
+		Slot *old = m_Slots;
+		size_t oldcapacity = m_Capacity;
+
+		m_Slots = new Slot[capacity];
+		m_Capacity = capacity;
+		m_Size = m_Used = 0;
+
+		for (size_t i = 0; i < oldcapacity; i++)
+		{
+			if (old[i].key != EMPTY && old[i].key != DELETED)
+				Insert(old[i].key, old[i].value);
+		}
+		delete[] old;
+	}
+
+	Slot *m_Slots = nullptr;
+	size_t m_Capacity = 0;
+	size_t m_Size = 0;
+	// Live entries + tombstones
+	size_t m_Used = 0;
+};
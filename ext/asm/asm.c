@@ -26,6 +26,19 @@
 * @param pc		The program counter value that needs to be set (usually the next address from the source).
 */
 void check_thunks(unsigned char *dest, unsigned char *pc)
+{
+	check_thunks_at(dest, dest, pc);
+}
+
+/**
+* Same as check_thunks, but for code that is written through a different mapping
+* than the one it will execute from.
+*
+* @param dest		Destination buffer where a call opcode + addr (5 bytes) has just been written.
+* @param dest_pc	Address that dest will be executed from.
+* @param pc		The program counter value that needs to be set (usually the next address from the source).
+*/
+void check_thunks_at(unsigned char *dest, unsigned char *dest_pc, unsigned char *pc)
 {
 #if defined(_WIN32) || defined(__x86_64__)
 	return;
@@ -33,7 +46,7 @@ void check_thunks(unsigned char *dest, unsigned char *pc)
 	/* Step write address back 4 to the start of the function address */
 	unsigned char *writeaddr = dest - 4;
 	unsigned char *calloffset = *(unsigned char **)writeaddr;
-	unsigned char *calladdr = (unsigned char *)(dest + (unsigned int)calloffset);
+	unsigned char *calladdr = (unsigned char *)(dest_pc + (unsigned int)calloffset);
 
 	/* Lookup name of function being called */
 	if ((*calladdr == 0x8B) && (*(calladdr+2) == 0x24) && (*(calladdr+3) == 0xC3))
@@ -90,6 +103,11 @@ void check_thunks(unsigned char *dest, unsigned char *pc)
 }
 
 int copy_bytes(unsigned char *func, unsigned char *dest, unsigned int required_len)
+{
+	return copy_bytes_at(func, dest, dest, required_len);
+}
+
+int copy_bytes_at(unsigned char *func, unsigned char *dest, unsigned char *dest_pc, unsigned int required_len)
 {
 	ud_t ud_obj;
 	ud_init(&ud_obj);
@@ -115,16 +133,19 @@ int copy_bytes(unsigned char *func, unsigned char *dest, unsigned int required_l
 			{
 				dest[0] = func[0];
 				dest++; func++;
+				dest_pc++;
 				if (ud_insn_opr(&ud_obj, 0)->size == 32)
 				{
-					*(int32_t *)dest = func + *(int32_t *)func - dest;
-					check_thunks(dest+4, func+4);
+					*(int32_t *)dest = func + *(int32_t *)func - dest_pc;
+					check_thunks_at(dest+4, dest_pc+4, func+4);
 					dest += sizeof(int32_t);
+					dest_pc += sizeof(int32_t);
 				}
 				else
 				{
-					*(int16_t *)dest = func + *(int16_t *)func - dest;
+					*(int16_t *)dest = func + *(int16_t *)func - dest_pc;
 					dest += sizeof(int16_t);
+					dest_pc += sizeof(int16_t);
 				}
 				func--;
 			}
@@ -132,6 +153,7 @@ int copy_bytes(unsigned char *func, unsigned char *dest, unsigned int required_l
 			{
 				memcpy(dest, func, insn_len);
 				dest += insn_len;
+				dest_pc += insn_len;
 			}
 		}
 
@@ -401,6 +423,12 @@ void inject_jmp(void* src, void* dest) {
 	*(long*)((unsigned char*)src+1) = (long)((unsigned char*)dest - ((unsigned char*)src + OP_JMP_SIZE));
 }
 
+//insert a JMP at src, as it will be seen when executed from src_pc
+void inject_jmp_at(void* src, void* src_pc, void* dest) {
+	*(unsigned char*)src = OP_JMP;
+	*(long*)((unsigned char*)src+1) = (long)((unsigned char*)dest - ((unsigned char*)src_pc + OP_JMP_SIZE));
+}
+
 //fill a given block with NOPs
 void fill_nop(void* src, unsigned int len) {
 	unsigned char* src2 = (unsigned char*)src;
@@ -432,12 +460,10 @@ void* eval_jump(void* src) {
 		}
 		return addr;
 	}
-	/*
 	//32bit offset
 	else if (addr[0] == OP_JMP) {
 		addr = &addr[OP_JMP_SIZE] + *(int*)&addr[1];
 	}
-	*/
 
 	return addr;
 }
@@ -18,19 +18,28 @@ extern "C" {
 #endif
 
 void check_thunks(unsigned char *dest, unsigned char *pc);
+void check_thunks_at(unsigned char *dest, unsigned char *dest_pc, unsigned char *pc);
 
 //if dest is NULL, returns minimum number of bytes needed to be copied
 //if dest is not NULL, it will copy the bytes to dest as well as fix CALLs and JMPs
 //http://www.devmaster.net/forums/showthread.php?t=2311
 int copy_bytes(unsigned char *func, unsigned char* dest, unsigned int required_len);
 
+//same as copy_bytes, but CALLs and JMPs are fixed up to run from dest_pc instead of dest
+//for when dest is a writable alias of executable memory
+int copy_bytes_at(unsigned char *func, unsigned char* dest, unsigned char* dest_pc, unsigned int required_len);
+
 //insert a specific JMP instruction at the given location
 void inject_jmp(void* src, void* dest);
 
+//insert a JMP at src that is relative to src_pc, the address src executes from
+void inject_jmp_at(void* src, void* src_pc, void* dest);
+
 //fill a given block with NOPs
 void fill_nop(void* src, unsigned int len);
 
 //evaluate a JMP at the target
+//returns where it goes, or src if it isn't a JMP
 void* eval_jump(void* src);
 
 #ifdef __cplusplus
@@ -0,0 +1,35 @@
+#include "budget.h"
+#include <chrono>
+
+uint32_t g_BudgetWindows[MidHookBudget_PeriodCount] = {};
+
+static std::chrono::steady_clock::time_point s_SecondStart;
+
+static void OnGameFrame(bool simulating)
+{
+	g_BudgetWindows[MidHookBudget_PerTick]++;
+
+	// Wall time, so a hibernating server doesn't stretch the seconds
+	auto now = std::chrono::steady_clock::now();
+	if (now - s_SecondStart >= std::chrono::seconds(1))
+	{
+		g_BudgetWindows[MidHookBudget_PerSecond]++;
+		s_SecondStart = now;
+	}
+}
+
+void StartBudgetClock()
+{
+	s_SecondStart = std::chrono::steady_clock::now();
+	smutils->AddGameFrameHook(&OnGameFrame);
+}
+
+void StopBudgetClock()
+{
+	smutils->RemoveGameFrameHook(&OnGameFrame);
+}
+
+const char *BudgetPeriodName(MidHookBudgetPeriod period)
+{
+	return period == MidHookBudget_PerTick ? "tick" : "second";
+}
@@ -0,0 +1,28 @@
+#pragma once
+
+#include "extension.h"
+
+// Matches MidHookBudgetPeriod in midhook.inc
+enum MidHookBudgetPeriod
+{
+	MidHookBudget_PerSecond,
+	MidHookBudget_PerTick,
+
+	MidHookBudget_PeriodCount
+};
+
+// Matches MidHookBudgetAction in midhook.inc
+enum MidHookBudgetAction
+{
+	MidHookBudget_Sample,
+	MidHookBudget_Disable
+};
+
+// How many of each period have gone by, counted from a game frame hook
+// A hook's spending starts over whenever the count for its period moves on
+extern uint32_t g_BudgetWindows[MidHookBudget_PeriodCount];
+
+void StartBudgetClock();
+void StopBudgetClock();
+
+const char *BudgetPeriodName(MidHookBudgetPeriod period);
@@ -0,0 +1,389 @@
+#include "console.h"
+#include "registry.h"
+#include "span.h"
+#include "coverage.h"
+
+#include "modules.h"
+
+#include <vector>
+#include <algorithm>
+
+struct PluginStats
+{
+	IPluginContext *owner = {};
+	const char *name = {};
+	uint64_t hits = {};
+	LatencyHistogram latency;
+};
+
+static void PrintLatency(const char *label, uint64_t hits, const LatencyHistogram &latency)
+{
+	rootconsole->ConsolePrint("  %-12llu %-10llu %-10llu %-10llu %-14llu %s",
+		(unsigned long long)hits,
+		(unsigned long long)latency.Percentile(50.0),
+		(unsigned long long)latency.Percentile(99.0),
+		(unsigned long long)latency.Max(),
+		(unsigned long long)latency.Total(),
+		label);
+}
+
+static void Command_Stats(const ICommandArgs *args)
+{
+	rootconsole->ConsolePrint("[SM] Profiling is %s, times are in cycles", g_Profiling ? "on" : "off");
+
+	std::vector<MidHook *> hooks;
+	g_Registry.ForEach([&hooks](MidHook *hook)
+	{
+		hooks.push_back(hook);
+	});
+
+	// Most expensive first
+	auto total = [](MidHook *hook)
+	{
+		return hook->Latency() ? hook->Latency()->Total() : 0;
+	};
+	std::sort(hooks.begin(), hooks.end(), [&total](MidHook *a, MidHook *b)
+	{
+		return total(a) > total(b);
+	});
+
+	LatencyHistogram empty;
+	std::vector<PluginStats> plugins;
+	char label[256];
+
+	rootconsole->ConsolePrint("  %-12s %-10s %-10s %-10s %-14s %s", "Calls", "p50", "p99", "Max", "Total", "Hook");
+	for (MidHook *hook : hooks)
+	{
+		const LatencyHistogram &latency = hook->Latency() ? *hook->Latency() : empty;
+		snprintf(label, sizeof(label), "%p (%s)", hook->Target(), hook->OwnerName());
+		PrintLatency(label, hook->Hits(), latency);
+
+		auto stats = std::find_if(plugins.begin(), plugins.end(), [hook](const PluginStats &stats)
+		{
+			return stats.owner == hook->Owner();
+		});
+
+		if (stats == plugins.end())
+		{
+			plugins.emplace_back();
+			stats = plugins.end() - 1;
+			stats->owner = hook->Owner();
+			stats->name = hook->OwnerName();
+		}
+
+		stats->hits += hook->Hits();
+		stats->latency.Merge(latency);
+	}
+
+	if (plugins.empty())
+		return;
+
+	std::sort(plugins.begin(), plugins.end(), [](const PluginStats &a, const PluginStats &b)
+	{
+		return a.latency.Total() > b.latency.Total();
+	});
+
+	rootconsole->ConsolePrint("");
+	rootconsole->ConsolePrint("  %-12s %-10s %-10s %-10s %-14s %s", "Calls", "p50", "p99", "Max", "Total", "Plugin");
+	for (const PluginStats &stats : plugins)
+		PrintLatency(stats.name, stats.hits, stats.latency);
+}
+
+// module+offset and the address itself
+static void DescribeAddress(const void *addr, char *buffer, size_t maxlen)
+{
+	char location[256];
+	FormatAddress(addr, location, sizeof(location));
+	snprintf(buffer, maxlen, "%s (%p)", location, addr);
+}
+
+static MidHook *FindHook(int id)
+{
+	MidHook *found = nullptr;
+	g_Registry.ForEach([id, &found](MidHook *hook)
+	{
+		if (hook->Id() == id)
+			found = hook;
+	});
+	return found;
+}
+
+static void Command_List(const ICommandArgs *args)
+{
+	std::vector<MidHook *> hooks;
+	g_Registry.ForEach([&hooks](MidHook *hook)
+	{
+		hooks.push_back(hook);
+	});
+
+	std::sort(hooks.begin(), hooks.end(), [](MidHook *a, MidHook *b)
+	{
+		return a->Id() < b->Id();
+	});
+
+	rootconsole->ConsolePrint("[SM] %u hooks, exec memory from \"%s\"", (unsigned)hooks.size(), g_ExecAllocator->Name());
+
+	char target[256];
+	for (MidHook *hook : hooks)
+	{
+		DescribeAddress(hook->Target(), target, sizeof(target));
+		rootconsole->ConsolePrint("  [%d] %s, %s, %s", hook->Id(), target, hook->OwnerName(), hook->Enabled() ? "enabled" : "disabled");
+
+		const LatencyHistogram *latency = hook->Latency();
+		rootconsole->ConsolePrint("      hits %llu, cycles %llu", (unsigned long long)hook->Hits(), (unsigned long long)(latency ? latency->Total() : 0));
+		if (hook->Span())
+			rootconsole->ConsolePrint("      %s of span %d", hook->SpanStop() ? "stop" : "start", hook->Span()->Id());
+		if (hook->Counter())
+			rootconsole->ConsolePrint("      block counter");
+		if (hook->SampleRate() > 1)
+			rootconsole->ConsolePrint("      sampled, 1 in %d hits", hook->SampleRate());
+
+		HookSite *site = hook->Site();
+		if (!site)
+			continue;
+
+		// Everything generated for this hook's boundary, the bridge and what it relocated
+		int offset = (int)((uint8_t *)hook->Target() - (uint8_t *)site->Target());
+		size_t used = 0;
+		for (const HookSite::Stub &stub : site->Stubs())
+		{
+			if (stub.offset != offset)
+				continue;
+
+			rootconsole->ConsolePrint("      %s %p, %u bytes", stub.bridge ? "bridge" : "trampoline", stub.exec, (unsigned)stub.size);
+			used += stub.size;
+		}
+		rootconsole->ConsolePrint("      window %d bytes at %p, %u exec bytes", site->ByteLen(), site->Target(), (unsigned)used);
+	}
+}
+
+static void Disassemble(const void *code, size_t size)
+{
+	ud_t ud;
+	ud_init(&ud);
+	ud_set_mode(&ud, 32);
+	ud_set_syntax(&ud, UD_SYN_INTEL);
+	ud_set_pc(&ud, (uintptr_t)code);
+	ud_set_input_buffer(&ud, (const uint8_t *)code, size);
+
+	while (ud_disassemble(&ud))
+		rootconsole->ConsolePrint("      %08x  %-24s %s", (unsigned)ud_insn_off(&ud), ud_insn_hex(&ud), ud_insn_asm(&ud));
+}
+
+static void Command_Dump(const ICommandArgs *args)
+{
+	if (args->ArgC() < 4)
+	{
+		rootconsole->ConsolePrint("[SM] Usage: sm midhooks dump <id>");
+		return;
+	}
+
+	int id = atoi(args->Arg(3));
+	MidHook *hook = FindHook(id);
+	if (!hook)
+	{
+		rootconsole->ConsolePrint("[SM] No hook with id %d, see sm midhooks list", id);
+		return;
+	}
+
+	HookSite *site = hook->Site();
+	if (!site)
+	{
+		rootconsole->ConsolePrint("[SM] Hook %d is disabled, nothing is generated for it", id);
+		return;
+	}
+
+	char target[256];
+	DescribeAddress(site->Target(), target, sizeof(target));
+	rootconsole->ConsolePrint("[SM] Window at %s, shared by everything hooked in it", target);
+	rootconsole->ConsolePrint("  patch:");
+	Disassemble(site->Target(), site->ByteLen());
+
+	// Stubs are kept in the order they were emitted, back to front
+	const std::vector<HookSite::Stub> &stubs = site->Stubs();
+	for (auto stub = stubs.rbegin(); stub != stubs.rend(); ++stub)
+	{
+		DescribeAddress((uint8_t *)site->Target() + stub->offset, target, sizeof(target));
+		rootconsole->ConsolePrint("  %s for %s:", stub->bridge ? "bridge" : "trampoline", target);
+		Disassemble(stub->exec, stub->size);
+	}
+
+	ValueSketch *sketch = hook->Sketch();
+	if (!sketch)
+		return;
+
+	ValueSketch::Entry top[10];
+	int count = sketch->Top(top, 10);
+	rootconsole->ConsolePrint("  top values of %llu:", (unsigned long long)sketch->Total());
+	for (int i = 0; i < count; i++)
+		rootconsole->ConsolePrint("      0x%08x %u", (unsigned)top[i].value, top[i].count);
+}
+
+static void Command_Spans(const ICommandArgs *args)
+{
+	// Each end runs through a bridge, and the dispatcher if it shares its address with other hooks
+	rootconsole->ConsolePrint("[SM] Times are in cycles, and include the exit of one bridge and the entry of another");
+
+	char start[256];
+	char stop[256];
+	HookSpan::ForEach([&start, &stop](HookSpan *span)
+	{
+		const LatencyHistogram &stats = span->Stats();
+		DescribeAddress(span->Start()->Target(), start, sizeof(start));
+		DescribeAddress(span->Stop()->Target(), stop, sizeof(stop));
+
+		rootconsole->ConsolePrint("  [%d] %s -> %s, %s, %s", span->Id(), start, stop, span->Start()->OwnerName(), span->Enabled() ? "enabled" : "disabled");
+		rootconsole->ConsolePrint("      count %llu, mean %llu, p50 %llu, p99 %llu, max %llu, total %llu",
+			(unsigned long long)stats.Count(),
+			(unsigned long long)(stats.Count() ? stats.Total() / stats.Count() : 0),
+			(unsigned long long)stats.Percentile(50.0),
+			(unsigned long long)stats.Percentile(99.0),
+			(unsigned long long)stats.Max(),
+			(unsigned long long)stats.Total());
+	});
+}
+
+static void Command_Stacks(const ICommandArgs *args)
+{
+	if (args->ArgC() < 4)
+	{
+		rootconsole->ConsolePrint("[SM] Usage: sm midhooks stacks <id> [count]");
+		return;
+	}
+
+	int id = atoi(args->Arg(3));
+	MidHook *hook = FindHook(id);
+	if (!hook)
+	{
+		rootconsole->ConsolePrint("[SM] No hook with id %d, see sm midhooks list", id);
+		return;
+	}
+
+	StackTable *stacks = hook->Stacks();
+	if (!stacks)
+	{
+		rootconsole->ConsolePrint("[SM] Hook %d is not collecting stacks", id);
+		return;
+	}
+
+	int max = args->ArgC() >= 5 ? atoi(args->Arg(4)) : 10;
+	std::vector<const StackTable::Entry *> top(std::min(std::max(max, 0), stacks->Size()));
+	int count = stacks->Top(top.data(), (int)top.size());
+
+	rootconsole->ConsolePrint("[SM] %d distinct stacks in %llu hits, %llu dropped", stacks->Size(),
+		(unsigned long long)stacks->Total(), (unsigned long long)stacks->Dropped());
+
+	char symbol[1024];
+	for (int i = 0; i < count; i++)
+	{
+		rootconsole->ConsolePrint("  %u hits (%.1f%%):", top[i]->count, 100.0 * top[i]->count / stacks->Total());
+		for (int frame = 0; frame < top[i]->depth; frame++)
+		{
+			FormatSymbol((const void *)top[i]->frames[frame], symbol, sizeof(symbol));
+			rootconsole->ConsolePrint("      %s", symbol);
+		}
+	}
+}
+
+static void Command_Coverage(const ICommandArgs *args)
+{
+	char location[256];
+
+	if (args->ArgC() < 4)
+	{
+		BlockCoverage::ForEach([&location](BlockCoverage *coverage)
+		{
+			DescribeAddress(coverage->Function(), location, sizeof(location));
+			IPlugin *plugin = coverage->Owner() ? plsys->FindPluginByContext(coverage->Owner()->GetContext()) : nullptr;
+			rootconsole->ConsolePrint("  [%d] %s, %d blocks, %d probed, %s, %s", coverage->Id(), location, (int)coverage->Blocks().size(),
+				coverage->Probed(), plugin ? plugin->GetFilename() : coverage->Owner() ? "<unknown>" : "<unloaded>", coverage->Enabled() ? "enabled" : "disabled");
+		});
+		rootconsole->ConsolePrint("[SM] sm midhooks coverage <id> for the blocks of one");
+		return;
+	}
+
+	int id = atoi(args->Arg(3));
+	BlockCoverage *found = nullptr;
+	BlockCoverage::ForEach([id, &found](BlockCoverage *coverage)
+	{
+		if (coverage->Id() == id)
+			found = coverage;
+	});
+
+	if (!found)
+	{
+		rootconsole->ConsolePrint("[SM] No coverage with id %d, see sm midhooks coverage", id);
+		return;
+	}
+
+	DescribeAddress(found->Function(), location, sizeof(location));
+	rootconsole->ConsolePrint("[SM] Blocks of %s", location);
+	for (const BlockCoverage::Block &block : found->Blocks())
+	{
+		FormatAddress(block.start, location, sizeof(location));
+		if (block.probe)
+			rootconsole->ConsolePrint("  %-40s %-6d %llu", location, block.size, (unsigned long long)block.probe->Hits());
+		else
+			rootconsole->ConsolePrint("  %-40s %-6d -", location, block.size);
+	}
+}
+
+static void Command_Profile(const ICommandArgs *args)
+{
+	const char *arg = args->ArgC() >= 4 ? args->Arg(3) : "";
+	if (!strcmp(arg, "on"))
+		g_Profiling = true;
+	else if (!strcmp(arg, "off"))
+		g_Profiling = false;
+	else if (!strcmp(arg, "reset"))
+	{
+		g_Registry.ForEach([](MidHook *hook)
+		{
+			hook->ResetStats();
+		});
+	}
+	else
+	{
+		rootconsole->ConsolePrint("[SM] Usage: sm midhooks profile <on|off|reset>");
+		return;
+	}
+
+	rootconsole->ConsolePrint("[SM] Profiling is %s", g_Profiling ? "on" : "off");
+}
+
+struct Subcommand
+{
+	const char *name;
+	const char *help;
+	void (*handler)(const ICommandArgs *args);
+};
+
+static const Subcommand s_Commands[] = {
+	{"list", "Every hook with its plugin, patch and generated code", Command_List},
+	{"coverage", "[id] Basic block hit counts", Command_Coverage},
+	{"dump", "<id> Disassemble the code generated for a hook", Command_Dump},
+	{"stacks", "<id> [count] The most common call stacks of a hook collecting them", Command_Stacks},
+	{"stats", "Hits and callback cycles per hook and plugin", Command_Stats},
+	{"profile", "<on|off|reset> Time hook callbacks", Command_Profile},
+	{"spans", "Time spent between the ends of each span", Command_Spans},
+};
+
+void OnMidHooksCommand(const ICommandArgs *args)
+{
+	if (args->ArgC() >= 3)
+	{
+		const char *name = args->Arg(2);
+		for (const Subcommand &command : s_Commands)
+		{
+			if (!strcmp(name, command.name))
+			{
+				command.handler(args);
+				return;
+			}
+		}
+	}
+
+	rootconsole->ConsolePrint("SourceMod MidHooks Menu:");
+	for (const Subcommand &command : s_Commands)
+		rootconsole->DrawGenericOption(command.name, command.help);
+}
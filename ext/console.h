@@ -0,0 +1,6 @@
+#pragma once
+
+#include "extension.h"
+
+// sm midhooks [command] [args]
+void OnMidHooksCommand(const ICommandArgs *args);
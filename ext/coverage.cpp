@@ -0,0 +1,288 @@
+#include "coverage.h"
+#include "midhook.h"
+#include "registry.h"
+#include "hooksite.h"
+#include "modules.h"
+
+#include <algorithm>
+#include <set>
+
+std::vector<BlockCoverage *> BlockCoverage::s_All;
+int BlockCoverage::s_NextId = 1;
+
+// Longest jump table we'll follow
+static constexpr int MAX_JUMP_TABLE = 1024;
+
+struct SweptInsn
+{
+	int offset;
+	int len;
+	// A relative branch that copy_bytes would copy as is, and so break
+	bool unrelocatable;
+};
+
+BlockCoverage *BlockCoverage::Create(void *function, int maxbytes, IPluginContext *owner, char *error, size_t maxlen)
+{
+	BlockCoverage *coverage = new BlockCoverage();
+	coverage->m_Function = (uint8_t *)function;
+	coverage->m_Owner = owner;
+
+	if (!coverage->Sweep(maxbytes, error, maxlen))
+	{
+		delete coverage;
+		return nullptr;
+	}
+
+	coverage->m_Id = s_NextId++;
+	s_All.push_back(coverage);
+	return coverage;
+}
+
+BlockCoverage::~BlockCoverage()
+{
+	for (const Block &block : m_Blocks)
+	{
+		if (block.probe)
+			g_Registry.Destroy(block.probe);
+	}
+
+	auto it = std::find(s_All.begin(), s_All.end(), this);
+	if (it != s_All.end())
+		s_All.erase(it);
+}
+
+static int JumpTarget(const ud_operand *op)
+{
+	switch (op->size)
+	{
+	case 8:
+		return op->lval.sbyte;
+	case 16:
+		return op->lval.sword;
+	default:
+		return op->lval.sdword;
+	}
+}
+
+bool BlockCoverage::Sweep(int maxbytes, char *error, size_t maxlen)
+{
+	ud_t ud;
+	ud_init(&ud);
+	ud_set_mode(&ud, 32);
+	ud_set_pc(&ud, (uintptr_t)m_Function);
+	ud_set_input_buffer(&ud, m_Function, maxbytes);
+
+	std::vector<SweptInsn> insns;
+	// Where blocks start, and where they end if not at the next start
+	std::set<int> starts = {0};
+	std::set<int> ends;
+	int furthest = 0;
+	int end = -1;
+
+	auto target = [&starts, &furthest, maxbytes](int offset)
+	{
+		// Tail calls and the like, not ours to probe
+		if (offset < 0 || offset >= maxbytes)
+			return;
+
+		starts.insert(offset);
+		furthest = std::max(furthest, offset);
+	};
+
+	while (ud_disassemble(&ud))
+	{
+		int offset = (int)(ud_insn_off(&ud) - (uintptr_t)m_Function);
+		int next = offset + (int)ud_insn_len(&ud);
+		enum ud_mnemonic_code mnemonic = ud_insn_mnemonic(&ud);
+		const ud_operand *op = ud_insn_opr(&ud, 0);
+
+		if (mnemonic == UD_Iinvalid)
+		{
+			snprintf(error, maxlen, "Could not decode the instruction at %p", m_Function + offset);
+			return false;
+		}
+
+		bool relative = op && op->type == UD_OP_JIMM;
+		bool rel32 = relative && op->size == 32 && (mnemonic == UD_Icall || mnemonic == UD_Ijmp);
+		insns.push_back({offset, next - offset, relative && !rel32});
+
+		bool terminal = false;
+		if (relative && mnemonic != UD_Icall)
+		{
+			int dest = next + JumpTarget(op);
+			terminal = mnemonic == UD_Ijmp;
+
+			// A jmp past everything seen so far could be a tail call into
+			// whatever is laid out after us. It is if its target starts a
+			// symbol, or is in a different one than ours, otherwise it's a
+			// jmp over the rest of an if/else and the sweep goes on
+			bool tail = false;
+			if (terminal && dest >= next && dest > furthest)
+			{
+				const void *symbol = SymbolStart(m_Function + dest);
+				tail = symbol && (symbol == m_Function + dest || symbol != SymbolStart(m_Function));
+			}
+
+			if (!tail)
+				target(dest);
+
+			// Conditional, so it falls through into a new block
+			if (!terminal)
+				starts.insert(next);
+			ends.insert(next);
+		}
+		else if (mnemonic == UD_Ijmp)
+		{
+			// jmp [table + index * 4], the table lists the cases
+			// Anything else could go anywhere, including the middle of a patch
+			int cases = 0;
+			if (op->type == UD_OP_MEM && op->base == UD_NONE && op->index != UD_NONE && op->scale == 4 && op->offset == 32)
+			{
+				const uintptr_t *table = (const uintptr_t *)(uintptr_t)op->lval.udword;
+				for (; cases < MAX_JUMP_TABLE; cases++)
+				{
+					intptr_t dest = (intptr_t)table[cases] - (intptr_t)m_Function;
+					if (dest < 0 || dest >= maxbytes)
+						break;
+					target((int)dest);
+				}
+			}
+
+			if (!cases)
+			{
+				snprintf(error, maxlen, "Can't tell where the indirect jmp at %p goes", m_Function + offset);
+				return false;
+			}
+
+			terminal = true;
+			ends.insert(next);
+		}
+		else if (mnemonic == UD_Iret || mnemonic == UD_Iretf || mnemonic == UD_Ihlt || mnemonic == UD_Iud2 || mnemonic == UD_Iint3)
+		{
+			terminal = true;
+			ends.insert(next);
+		}
+
+		// Nothing seen so far branches past here, so this is the end
+		if (terminal && next > furthest)
+		{
+			end = next;
+			break;
+		}
+	}
+
+	if (end == -1)
+	{
+		snprintf(error, maxlen, "Found no end to the function at %p within %d bytes", m_Function, maxbytes);
+		return false;
+	}
+
+	auto find = [&insns](int offset)
+	{
+		return std::lower_bound(insns.begin(), insns.end(), offset, [](const SweptInsn &insn, int offset)
+		{
+			return insn.offset < offset;
+		});
+	};
+
+	auto boundary = [&insns, &find](int offset)
+	{
+		auto insn = find(offset);
+		return insn != insns.end() && insn->offset == offset;
+	};
+
+	for (auto start = starts.begin(); start != starts.end(); ++start)
+	{
+		if (!boundary(*start))
+		{
+			snprintf(error, maxlen, "Something branches into the middle of the instruction at %p", m_Function + *start);
+			return false;
+		}
+
+		// The sweep stopped at an end, so every block has one after it
+		auto nextstart = std::next(start);
+		int blockend = std::min(nextstart == starts.end() ? end : *nextstart, *ends.upper_bound(*start));
+
+		Block block = {m_Function + *start, blockend - *start, nullptr};
+
+		// The window HookSite will take has to stay in the block, be safe to
+		// relocate, and end where we think an instruction does
+		int window = copy_bytes(block.start, nullptr, OP_JMP_SIZE);
+		bool safe = window <= block.size && (window == block.size || boundary(*start + window));
+		for (auto insn = find(*start); safe && insn != insns.end() && insn->offset < *start + window; ++insn)
+			safe = !insn->unrelocatable;
+
+		if (safe)
+		{
+			block.probe = new MidHook(block.start, nullptr, m_Owner, 0);
+			block.probe->SetCounter();
+			g_Registry.Add(block.probe);
+		}
+
+		m_Blocks.push_back(block);
+	}
+	return true;
+}
+
+bool BlockCoverage::Enable(char *error, size_t maxlen)
+{
+	// All or nothing, and none of it is patched in until all of it is built
+	HookSite::BeginBatch();
+
+	std::vector<MidHook *> enabled;
+	for (const Block &block : m_Blocks)
+	{
+		if (!block.probe || block.probe->Enabled())
+			continue;
+
+		if (!block.probe->Enable(error, maxlen))
+		{
+			for (MidHook *probe : enabled)
+				probe->Disable();
+			HookSite::EndBatch();
+			return false;
+		}
+		enabled.push_back(block.probe);
+	}
+
+	HookSite::EndBatch();
+	return true;
+}
+
+bool BlockCoverage::Disable()
+{
+	bool disabled = false;
+	for (const Block &block : m_Blocks)
+	{
+		if (block.probe && block.probe->Disable())
+			disabled = true;
+	}
+	return disabled;
+}
+
+bool BlockCoverage::Enabled()
+{
+	for (const Block &block : m_Blocks)
+	{
+		if (block.probe && !block.probe->Enabled())
+			return false;
+	}
+	return Probed() > 0;
+}
+
+void BlockCoverage::Reset()
+{
+	for (const Block &block : m_Blocks)
+	{
+		if (block.probe)
+			block.probe->ResetStats();
+	}
+}
+
+int BlockCoverage::Probed()
+{
+	return (int)std::count_if(m_Blocks.begin(), m_Blocks.end(), [](const Block &block)
+	{
+		return block.probe != nullptr;
+	});
+}
@@ -0,0 +1,72 @@
+#pragma once
+
+#include "extension.h"
+#include <vector>
+
+class MidHook;
+
+// Hit counts for the basic blocks of a function
+// Blocks are found with a linear sweep from the start of the function, split at
+// every branch and branch target, until a ret or jmp past the last target seen.
+// A jmp further on than anything seen is a tail call, and doesn't keep the sweep
+// going, only if the exported symbols put its target in another function
+// Every block that can take a patch on its own gets a counter, a MidHook with a
+// bridge that bumps its hit count and does nothing else (see HookSite::EmitCounter)
+// A block can't if its patch window would reach into the next block, where a
+// branch could land in the middle of our jmp, or would have to relocate a short
+// or conditional branch
+class BlockCoverage
+{
+public:
+	struct Block
+	{
+		uint8_t *start;
+		int size;
+		// nullptr if the block couldn't be probed
+		MidHook *probe;
+	};
+
+	static constexpr int MAX_BYTES = 65536;
+
+	// If the function can't be swept safely, error is filled
+	static BlockCoverage *Create(void *function, int maxbytes, IPluginContext *owner, char *error, size_t maxlen);
+	~BlockCoverage();
+
+	// Every probe or none, if this fails error is filled
+	// Built as one batch, see HookSite::BeginBatch
+	bool Enable(char *error, size_t maxlen);
+	// Returns false if no probe was enabled
+	bool Disable();
+	bool Enabled();
+	void Reset();
+
+	int Id() { return m_Id; }
+	void *Function() { return m_Function; }
+	// nullptr once the plugin has unloaded, see MidHook::Release
+	IPluginContext *Owner() { return m_Owner; }
+	void Release() { m_Owner = nullptr; }
+	const std::vector<Block> &Blocks() { return m_Blocks; }
+	int Probed();
+
+	// f(BlockCoverage *)
+	template <typename F>
+	static void ForEach(F f)
+	{
+		for (BlockCoverage *coverage : s_All)
+			f(coverage);
+	}
+
+private:
+	BlockCoverage() = default;
+
+	// Fills m_Blocks
+	bool Sweep(int maxbytes, char *error, size_t maxlen);
+
+	int m_Id = {};
+	uint8_t *m_Function = {};
+	IPluginContext *m_Owner = {};
+	std::vector<Block> m_Blocks;
+
+	static std::vector<BlockCoverage *> s_All;
+	static int s_NextId;
+};
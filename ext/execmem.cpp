@@ -0,0 +1,451 @@
+#include "execmem.h"
+
+#include <algorithm>
+#include <iterator>
+#include <map>
+#include <vector>
+
+#if defined _LINUX
+#include <errno.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <link.h>
+
+#ifndef MFD_CLOEXEC
+#define MFD_CLOEXEC 0x0001U
+#endif
+
+// Don't let a hint clobber an existing mapping on kernels that know how to
+// refuse, older kernels treat it as a plain hint which we check for anyway
+#ifdef MAP_FIXED_NOREPLACE
+#define MAP_NEAR_FLAGS(hint) ((hint) ? MAP_FIXED_NOREPLACE : 0)
+#else
+#define MAP_NEAR_FLAGS(hint) 0
+#endif
+#endif
+
+IExecAllocator *g_ExecAllocator = nullptr;
+
+// What we've always done
+class PageMemoryAllocator : public IExecAllocator
+{
+public:
+	const char *Name() override
+	{
+		return "sourcemod";
+	}
+
+	bool Alloc(size_t size, const void *near, CodeBlock *block) override
+	{
+		void *mem = smutils->GetScriptingEngine()->AllocatePageMemory(size);
+		if (!mem)
+			return false;
+
+		block->exec = mem;
+		block->write = mem;
+		return true;
+	}
+
+	void Free(void *exec) override
+	{
+		smutils->GetScriptingEngine()->FreePageMemory(exec);
+	}
+};
+
+#if defined _LINUX
+// Stubs are tiny, so they are packed into chunks instead of each getting
+// their own mapping
+// Chunks are placed right next to the module that holds the hooked code so
+// the rel32 jmps between the target, bridge and trampoline stay short
+// (and stay in reach at all, should this ever run on x64)
+class ChunkAllocator : public IExecAllocator
+{
+public:
+	~ChunkAllocator()
+	{
+		for (Chunk *chunk : m_Chunks)
+			Release(chunk);
+	}
+
+	bool Alloc(size_t size, const void *near, CodeBlock *block) override
+	{
+		size = (size + ALIGN - 1) & ~(ALIGN - 1);
+
+		uintptr_t modstart = 0, modend = 0;
+		if (near)
+			FindModule(near, &modstart, &modend);
+
+		for (Chunk *chunk : m_Chunks)
+		{
+			if (near && !InReach(chunk, near, modstart, modend))
+				continue;
+
+			if (Carve(chunk, size, block))
+				return true;
+		}
+
+		size_t pagesize = (size_t)sysconf(_SC_PAGESIZE);
+		size_t chunksize = size > CHUNK_SIZE ? (size + pagesize - 1) & ~(pagesize - 1) : CHUNK_SIZE;
+		Chunk *chunk = nullptr;
+		if (modend)
+			chunk = MapNear(chunksize, modstart, modend);
+		if (!chunk)
+			chunk = Map(chunksize, nullptr);
+		if (!chunk)
+			return false;
+
+		m_Chunks.push_back(chunk);
+		return Carve(chunk, size, block);
+	}
+
+	void Free(void *exec) override
+	{
+		auto it = m_Allocs.find((uint8_t *)exec);
+		if (it == m_Allocs.end())
+			return;
+
+		Chunk *chunk = it->second.chunk;
+		size_t offset = (uint8_t *)exec - chunk->exec;
+		size_t len = it->second.size;
+		m_Allocs.erase(it);
+
+		// Anything that still jumps here should trap, not run stale code
+		memset(chunk->write + offset, 0xcc, len);
+
+		// Coalesce with neighbors
+		auto next = chunk->free.lower_bound(offset);
+		if (next != chunk->free.end() && offset + len == next->first)
+		{
+			len += next->second;
+			next = chunk->free.erase(next);
+		}
+		if (next != chunk->free.begin())
+		{
+			auto prev = std::prev(next);
+			if (prev->first + prev->second == offset)
+			{
+				offset = prev->first;
+				len += prev->second;
+				chunk->free.erase(prev);
+			}
+		}
+		chunk->free[offset] = len;
+
+		// Keep one chunk around so toggling a single hook doesn't remap every time
+		if (len == chunk->size && m_Chunks.size() > 1)
+		{
+			m_Chunks.erase(std::find(m_Chunks.begin(), m_Chunks.end(), chunk));
+			Release(chunk);
+		}
+	}
+
+	// Check that the kernel will actually let us do this before committing to it
+	bool Probe(char *error, size_t maxlen)
+	{
+		Chunk *chunk = Map(CHUNK_SIZE, nullptr);
+		if (!chunk)
+		{
+			snprintf(error, maxlen, "%s", strerror(errno));
+			return false;
+		}
+
+		m_Chunks.push_back(chunk);
+		return true;
+	}
+
+protected:
+	struct Chunk
+	{
+		uint8_t *exec;
+		uint8_t *write;
+		size_t size;
+		// Offset -> length
+		std::map<size_t, size_t> free;
+	};
+
+	// Map size bytes, executable at hint if possible
+	// The kernel is free to ignore the hint
+	virtual bool MapPages(size_t size, void *hint, uint8_t **exec, uint8_t **write) = 0;
+
+private:
+	static constexpr size_t CHUNK_SIZE = 0x10000;
+	static constexpr size_t ALIGN = 16;
+	// How many chunk-sized steps away from a module we'll try before giving up
+	static constexpr int NEAR_PROBES = 64;
+	// rel32, with some slack for the stub itself
+	static constexpr uint64_t REL32_REACH = 0x7fff0000;
+
+	struct Allocation
+	{
+		Chunk *chunk;
+		size_t size;
+	};
+
+	struct ModuleQuery
+	{
+		uintptr_t addr;
+		uintptr_t start;
+		uintptr_t end;
+	};
+
+	static int FindModuleCallback(struct dl_phdr_info *info, size_t size, void *data)
+	{
+		ModuleQuery *query = (ModuleQuery *)data;
+		uintptr_t start = UINTPTR_MAX, end = 0;
+		for (int i = 0; i < info->dlpi_phnum; i++)
+		{
+			const ElfW(Phdr) &phdr = info->dlpi_phdr[i];
+			if (phdr.p_type != PT_LOAD)
+				continue;
+
+			start = std::min(start, (uintptr_t)(info->dlpi_addr + phdr.p_vaddr));
+			end = std::max(end, (uintptr_t)(info->dlpi_addr + phdr.p_vaddr + phdr.p_memsz));
+		}
+
+		if (query->addr >= start && query->addr < end)
+		{
+			query->start = start;
+			query->end = end;
+			return 1;
+		}
+		return 0;
+	}
+
+	static bool FindModule(const void *addr, uintptr_t *start, uintptr_t *end)
+	{
+		ModuleQuery query = {(uintptr_t)addr, 0, 0};
+		if (!dl_iterate_phdr(FindModuleCallback, &query))
+			return false;
+
+		*start = query.start;
+		*end = query.end;
+		return true;
+	}
+
+	static uint64_t Distance(uintptr_t a, uintptr_t b)
+	{
+		return a > b ? a - b : b - a;
+	}
+
+	// Every byte of the chunk must be reachable from every byte of the module
+	static bool InReach(uintptr_t chunkstart, size_t chunksize, uintptr_t modstart, uintptr_t modend)
+	{
+		return Distance(chunkstart, modend) <= REL32_REACH
+			&& Distance(chunkstart + chunksize, modstart) <= REL32_REACH;
+	}
+
+	static bool InReach(Chunk *chunk, const void *near, uintptr_t modstart, uintptr_t modend)
+	{
+		if (!modend)
+			return InReach((uintptr_t)chunk->exec, chunk->size, (uintptr_t)near, (uintptr_t)near + 1);
+		return InReach((uintptr_t)chunk->exec, chunk->size, modstart, modend);
+	}
+
+	// Walk outwards from the module, alternating between just above and
+	// just below it, until the kernel gives us what we asked for
+	Chunk *MapNear(size_t size, uintptr_t modstart, uintptr_t modend)
+	{
+		uintptr_t pagesize = (uintptr_t)sysconf(_SC_PAGESIZE);
+		uintptr_t above = (modend + pagesize - 1) & ~(pagesize - 1);
+		uintptr_t below = modstart & ~(pagesize - 1);
+
+		for (int i = 0; i < NEAR_PROBES * 2; i++)
+		{
+			uintptr_t hint;
+			if (i & 1)
+			{
+				if (below < size + pagesize)
+					continue;
+				below -= size;
+				hint = below;
+			}
+			else
+			{
+				if (above > UINTPTR_MAX - size)
+					continue;
+				hint = above;
+				above += size;
+			}
+
+			Chunk *chunk = Map(size, (void *)hint);
+			if (!chunk)
+				continue;
+
+			if ((uintptr_t)chunk->exec == hint)
+				return chunk;
+
+			// Somewhere else entirely, try the next slot
+			Release(chunk);
+		}
+		return nullptr;
+	}
+
+	Chunk *Map(size_t size, void *hint)
+	{
+		Chunk *chunk = new Chunk;
+		if (!MapPages(size, hint, &chunk->exec, &chunk->write))
+		{
+			delete chunk;
+			return nullptr;
+		}
+
+		memset(chunk->write, 0xcc, size);
+		chunk->size = size;
+		chunk->free[0] = size;
+		return chunk;
+	}
+
+	static void Release(Chunk *chunk)
+	{
+		munmap(chunk->exec, chunk->size);
+		if (chunk->write != chunk->exec)
+			munmap(chunk->write, chunk->size);
+		delete chunk;
+	}
+
+	bool Carve(Chunk *chunk, size_t size, CodeBlock *block)
+	{
+		for (auto it = chunk->free.begin(); it != chunk->free.end(); ++it)
+		{
+			if (it->second < size)
+				continue;
+
+			size_t offset = it->first;
+			size_t remaining = it->second - size;
+			chunk->free.erase(it);
+			if (remaining)
+				chunk->free[offset + size] = remaining;
+
+			block->exec = chunk->exec + offset;
+			block->write = chunk->write + offset;
+			m_Allocs[chunk->exec + offset] = {chunk, size};
+			return true;
+		}
+		return false;
+	}
+
+	std::vector<Chunk *> m_Chunks;
+	std::map<uint8_t *, Allocation> m_Allocs;
+};
+
+// Plain RWX pages, but placed near the hooked module
+class NearAllocator : public ChunkAllocator
+{
+public:
+	const char *Name() override
+	{
+		return "near";
+	}
+
+protected:
+	bool MapPages(size_t size, void *hint, uint8_t **exec, uint8_t **write) override
+	{
+		void *mem = mmap(hint, size, PROT_READ | PROT_WRITE | PROT_EXEC, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NEAR_FLAGS(hint), -1, 0);
+		if (mem == MAP_FAILED)
+			return false;
+
+		*exec = (uint8_t *)mem;
+		*write = (uint8_t *)mem;
+		return true;
+	}
+};
+
+// Each chunk is a memfd that is mapped twice, RW for us and RX for the CPU
+// Nothing is ever writable and executable at the same time
+class DualMapAllocator : public ChunkAllocator
+{
+public:
+	const char *Name() override
+	{
+		return "memfd";
+	}
+
+protected:
+	bool MapPages(size_t size, void *hint, uint8_t **exec, uint8_t **write) override
+	{
+#if defined __NR_memfd_create
+		int fd = (int)syscall(__NR_memfd_create, "midhooks", MFD_CLOEXEC);
+#else
+		int fd = -1;
+		errno = ENOSYS;
+#endif
+		if (fd == -1)
+			return false;
+
+		if (ftruncate(fd, (off_t)size) == -1)
+		{
+			close(fd);
+			return false;
+		}
+
+		void *w = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+		if (w == MAP_FAILED)
+		{
+			close(fd);
+			return false;
+		}
+
+		void *x = mmap(hint, size, PROT_READ | PROT_EXEC, MAP_SHARED | MAP_NEAR_FLAGS(hint), fd, 0);
+		if (x == MAP_FAILED)
+		{
+			int err = errno;
+			munmap(w, size);
+			close(fd);
+			errno = err;
+			return false;
+		}
+
+		// The mappings hold their own reference
+		close(fd);
+
+		*exec = (uint8_t *)x;
+		*write = (uint8_t *)w;
+		return true;
+	}
+};
+#endif
+
+void CreateExecAllocator()
+{
+	const char *backend = smutils->GetCoreConfigValue("MidHookExecMemory");
+
+#if defined _LINUX
+	if (!backend)
+		backend = "near";
+
+	ChunkAllocator *allocator = nullptr;
+	if (!strcmp(backend, "near"))
+		allocator = new NearAllocator();
+	else if (!strcmp(backend, "memfd"))
+		allocator = new DualMapAllocator();
+
+	if (allocator)
+	{
+		char error[256];
+		if (allocator->Probe(error, sizeof(error)))
+		{
+			g_ExecAllocator = allocator;
+			return;
+		}
+
+		smutils->LogError(myself, "Could not create %s executable memory (%s), falling back to SourceMod's allocator", allocator->Name(), error);
+		delete allocator;
+	}
+	else
+#endif
+	if (backend && strcmp(backend, "sourcemod"))
+	{
+		smutils->LogError(myself, "Unsupported MidHookExecMemory value \"%s\", falling back to SourceMod's allocator", backend);
+	}
+
+	g_ExecAllocator = new PageMemoryAllocator();
+}
+
+void DestroyExecAllocator()
+{
+	delete g_ExecAllocator;
+	g_ExecAllocator = nullptr;
+}
@@ -0,0 +1,37 @@
+#pragma once
+
+#include "extension.h"
+
+// A block of generated code
+// exec is the address the code runs from, and what any relative
+// displacements inside of it must be computed against
+// write is where the code is written to
+// With SourceMod's page memory these are the same, with the memfd
+// backend they are two views of the same pages, one RW and one RX
+struct CodeBlock
+{
+	void *exec;
+	void *write;
+};
+
+class IExecAllocator
+{
+public:
+	virtual ~IExecAllocator() {}
+
+	virtual const char *Name() = 0;
+	// near is the code the block will jump to and from, if the backend
+	// can, the block is placed within rel32 reach of near's module
+	virtual bool Alloc(size_t size, const void *near, CodeBlock *block) = 0;
+	virtual void Free(void *exec) = 0;
+};
+
+// Picks a backend from the "MidHookExecMemory" core.cfg key
+// "sourcemod" - RWX memory from AllocatePageMemory, the default off of Linux
+// "near" - RWX pages mapped next to the hooked module, the default on Linux
+// "memfd" - W^X, a memfd mapped once RW and once RX next to the hooked module, Linux only
+// Falls back to "sourcemod" if the requested backend is unavailable
+void CreateExecAllocator();
+void DestroyExecAllocator();
+
+extern IExecAllocator *g_ExecAllocator;
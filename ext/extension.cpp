@@ -1,6 +1,15 @@
 
 #include "extension.h"
 #include "midhook.h"
+#include "registry.h"
+#include "console.h"
+#include "perfmap.h"
+#include "gdbjit.h"
+#include "trace.h"
+#include "span.h"
+#include "coverage.h"
+#include "profiler.h"
+#include "budget.h"
 
 /**
  * @file extension.cpp
@@ -10,6 +19,8 @@
 SMMidHook g_SMMidHook;		/**< Global singleton for extension's main interface */
 HandleType_t g_MidHookType = NO_HANDLE_TYPE;
 HandleType_t g_MidHookRegistersType = NO_HANDLE_TYPE;
+HandleType_t g_MidHookSpanType = NO_HANDLE_TYPE;
+HandleType_t g_MidHookCoverageType = NO_HANDLE_TYPE;
 
 bool SMMidHook::SDK_OnLoad(char *error, size_t maxlen, bool late)
 {
@@ -28,36 +39,87 @@ bool SMMidHook::SDK_OnLoad(char *error, size_t maxlen, bool late)
 		return false;
 	}
 
+	g_MidHookSpanType = handlesys->CreateType("MidHookSpan", this, 0, nullptr, nullptr, myself->GetIdentity(), &err);
+	if (g_MidHookSpanType == NO_HANDLE_TYPE)
+	{
+		snprintf(error, maxlen, "Could not create MidHookSpan handle type (err: %d)", err);
+		return false;
+	}
+
+	g_MidHookCoverageType = handlesys->CreateType("MidHookCoverage", this, 0, nullptr, nullptr, myself->GetIdentity(), &err);
+	if (g_MidHookCoverageType == NO_HANDLE_TYPE)
+	{
+		snprintf(error, maxlen, "Could not create MidHookCoverage handle type (err: %d)", err);
+		return false;
+	}
+
+	CreateExecAllocator();
+	CreatePerfMap();
+	WatchProfilingTool();
+	StartBudgetClock();
+	HookSite::StartGraveyard();
+
 	sharesys->AddDependency(myself, "bintools.ext", true, true);
 	sharesys->RegisterLibrary(myself, "midhooks");
 	sharesys->AddNatives(myself, g_Natives);
 	plsys->AddPluginsListener(this);
+	rootconsole->AddRootConsoleCommand3("midhooks", "MidHooks extension", this);
 
 	return true;
 }
 
 void SMMidHook::SDK_OnUnload()
 {
-	MidHook::Cleanup();
+	rootconsole->RemoveRootConsoleCommand("midhooks", this);
+	UnwatchProfilingTool();
+	StopBudgetClock();
+	HookSite::StopGraveyard();
 
+	// Freeing the handles deletes their hooks
 	handlesys->RemoveType(g_MidHookType, myself->GetIdentity());
 	handlesys->RemoveType(g_MidHookRegistersType, myself->GetIdentity());
+	handlesys->RemoveType(g_MidHookSpanType, myself->GetIdentity());
+	handlesys->RemoveType(g_MidHookCoverageType, myself->GetIdentity());
+
+	g_Registry.DestroyAll();
+	HookSite::FlushGraveyard();
+	DestroyPerfMap();
+	CloseTraceFile();
+	// Orphaned stubs outlive their sites, but not us
+	GdbJitRemoveAll();
+	DestroyExecAllocator();
 }
 
 void SMMidHook::OnHandleDestroy(HandleType_t type, void *obj)
 {
 	if (type == g_MidHookType)
-		MidHook::Cleanup((MidHook *)obj);
+		g_Registry.Destroy((MidHook *)obj);
+	else if (type == g_MidHookSpanType)
+		delete (HookSpan *)obj;
+	else if (type == g_MidHookCoverageType)
+		delete (BlockCoverage *)obj;
 	else if (type == g_MidHookRegistersType)
 	{
 		// Nothing
 	}
 }
 
-// Won't handlesys already take care of this?
+// handlesys frees the plugin's MidHook handles, but only after this
+// Unhook now so nothing calls into a plugin that's going away, and forget
+// the plugin so handles cloned elsewhere don't reach into it later
 void SMMidHook::OnPluginUnloaded(IPlugin* plugin)
 {
-	MidHook::Cleanup(plugin->GetBaseContext());
+	g_Registry.Release(plugin->GetBaseContext());
+	BlockCoverage::ForEach([plugin](BlockCoverage *coverage)
+	{
+		if (coverage->Owner() == plugin->GetBaseContext())
+			coverage->Release();
+	});
+}
+
+void SMMidHook::OnRootConsoleCommand(const char *cmdname, const ICommandArgs *args)
+{
+	OnMidHooksCommand(args);
 }
 
 SMEXT_LINK(&g_SMMidHook);
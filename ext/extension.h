@@ -44,7 +44,7 @@
  * @brief Sample implementation of the SDK Extension.
  * Note: Uncomment one of the pre-defined virtual functions in order to use it.
  */
-class SMMidHook : public SDKExtension, public IHandleTypeDispatch, public IPluginsListener
+class SMMidHook : public SDKExtension, public IHandleTypeDispatch, public IPluginsListener, public IRootConsoleCommand
 {
 public:
 	/**
@@ -64,6 +64,7 @@ public:
 
 	virtual void OnHandleDestroy(HandleType_t, void*);
 	virtual void OnPluginUnloaded(IPlugin *);
+	virtual void OnRootConsoleCommand(const char *cmdname, const ICommandArgs *args);
 
 	/**
 	 * @brief This is called once all known extensions have been loaded.
@@ -122,5 +123,7 @@ public:
 extern sp_nativeinfo_t g_Natives[];
 extern HandleType_t g_MidHookType;
 extern HandleType_t g_MidHookRegistersType;
+extern HandleType_t g_MidHookSpanType;
+extern HandleType_t g_MidHookCoverageType;
 
 #endif // _INCLUDE_SOURCEMOD_EXTENSION_PROPER_H_
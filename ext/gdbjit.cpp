@@ -0,0 +1,390 @@
+#include "gdbjit.h"
+
+#if defined _LINUX
+#include <elf.h>
+#include <string.h>
+
+#include <map>
+
+// https://sourceware.org/gdb/current/onlinedocs/gdb.html/JIT-Interface.html
+// The debugger breaks on __jit_debug_register_code and reads the descriptor
+// to find out what was added or removed
+extern "C"
+{
+	enum jit_actions_t
+	{
+		JIT_NOACTION = 0,
+		JIT_REGISTER_FN,
+		JIT_UNREGISTER_FN
+	};
+
+	struct jit_code_entry
+	{
+		jit_code_entry *next_entry;
+		jit_code_entry *prev_entry;
+		const char *symfile_addr;
+		uint64_t symfile_size;
+	};
+
+	struct jit_descriptor
+	{
+		uint32_t version;
+		uint32_t action_flag;
+		jit_code_entry *relevant_entry;
+		jit_code_entry *first_entry;
+	};
+
+	__attribute__((noinline, visibility("default"))) void __jit_debug_register_code()
+	{
+		__asm__ __volatile__("");
+	}
+
+	__attribute__((visibility("default"))) jit_descriptor __jit_debug_descriptor = {1, JIT_NOACTION, nullptr, nullptr};
+}
+
+struct JitObject
+{
+	jit_code_entry entry;
+	std::vector<uint8_t> elf;
+};
+
+static std::map<const void *, JitObject *> s_Objects;
+
+// DWARF bits we use
+static constexpr uint8_t DW_CFA_nop = 0x00;
+static constexpr uint8_t DW_CFA_advance_loc4 = 0x04;
+static constexpr uint8_t DW_CFA_same_value = 0x08;
+static constexpr uint8_t DW_CFA_def_cfa = 0x0c;
+static constexpr uint8_t DW_CFA_def_cfa_offset = 0x0e;
+static constexpr uint8_t DW_CFA_val_expression = 0x16;
+static constexpr uint8_t DW_CFA_offset = 0x80;
+static constexpr uint8_t DW_OP_const4u = 0x0c;
+static constexpr uint8_t DW_EH_PE_udata4 = 0x03;
+static constexpr uint8_t DW_EH_PE_textrel = 0x20;
+
+// i386 DWARF numbers the GPRs in encoding order
+static constexpr int DW_REG_ESP = 4;
+static constexpr int DW_REG_EIP = 8;
+
+class Writer
+{
+public:
+	std::vector<uint8_t> &Buffer() { return m_Buffer; }
+	size_t Size() { return m_Buffer.size(); }
+
+	void Byte(uint8_t b)
+	{
+		m_Buffer.push_back(b);
+	}
+
+	void U32(uint32_t val)
+	{
+		Bytes(&val, sizeof(val));
+	}
+
+	void Bytes(const void *data, size_t size)
+	{
+		m_Buffer.insert(m_Buffer.end(), (const uint8_t *)data, (const uint8_t *)data + size);
+	}
+
+	void String(const char *str)
+	{
+		Bytes(str, strlen(str) + 1);
+	}
+
+	void ULEB(uint32_t val)
+	{
+		do
+		{
+			uint8_t b = val & 0x7f;
+			val >>= 7;
+			Byte(val ? b | 0x80 : b);
+		} while (val);
+	}
+
+	void SLEB(int32_t val)
+	{
+		bool more = true;
+		while (more)
+		{
+			uint8_t b = val & 0x7f;
+			val >>= 7;
+			more = !((val == 0 && !(b & 0x40)) || (val == -1 && (b & 0x40)));
+			Byte(more ? b | 0x80 : b);
+		}
+	}
+
+	void Align(size_t align, uint8_t fill)
+	{
+		while (m_Buffer.size() % align)
+			Byte(fill);
+	}
+
+	// Fills in a length field at offset, covering everything after it
+	void PatchLength(size_t offset)
+	{
+		uint32_t len = (uint32_t)(m_Buffer.size() - offset - sizeof(uint32_t));
+		memcpy(&m_Buffer[offset], &len, sizeof(len));
+	}
+
+	template <typename T>
+	void Patch(size_t offset, const T &val)
+	{
+		memcpy(&m_Buffer[offset], &val, sizeof(val));
+	}
+
+private:
+	std::vector<uint8_t> m_Buffer;
+};
+
+static void WriteRegisterRule(Writer &w, int reg, uint32_t saved)
+{
+	if (saved)
+	{
+		// Factored by the data alignment of -4
+		w.Byte(DW_CFA_offset | reg);
+		w.ULEB(saved / 4);
+	}
+	else
+	{
+		w.Byte(DW_CFA_same_value);
+		w.ULEB(reg);
+	}
+}
+
+// One CIE and one FDE covering the stub, addresses relative to .text
+static void WriteEhFrame(Writer &w, size_t size, const std::vector<UnwindRow> &rows)
+{
+	size_t cie = w.Size();
+	w.U32(0);
+	w.U32(0);
+	w.Byte(1);
+	// S marks it as a signal frame, so the address we give for the hooked
+	// code is used as is rather than as a return address just past a call
+	w.String("zRS");
+	w.ULEB(1);
+	w.SLEB(-4);
+	w.ULEB(DW_REG_EIP);
+	w.ULEB(1);
+	w.Byte(DW_EH_PE_textrel | DW_EH_PE_udata4);
+	w.Align(4, DW_CFA_nop);
+	w.PatchLength(cie);
+
+	size_t fde = w.Size();
+	w.U32(0);
+	w.U32((uint32_t)(w.Size() - cie));
+	w.U32(0);
+	w.U32((uint32_t)size);
+	w.ULEB(0);
+
+	const UnwindRow *prev = nullptr;
+	for (const UnwindRow &row : rows)
+	{
+		if (prev && row.pc != prev->pc)
+		{
+			w.Byte(DW_CFA_advance_loc4);
+			w.U32(row.pc - prev->pc);
+		}
+
+		if (!prev)
+		{
+			w.Byte(DW_CFA_def_cfa);
+			w.ULEB(DW_REG_ESP);
+			w.ULEB(row.cfa);
+		}
+		else if (row.cfa != prev->cfa)
+		{
+			w.Byte(DW_CFA_def_cfa_offset);
+			w.ULEB(row.cfa);
+		}
+
+		if (!prev || row.ra != prev->ra)
+		{
+			w.Byte(DW_CFA_val_expression);
+			w.ULEB(DW_REG_EIP);
+			w.ULEB(1 + sizeof(uint32_t));
+			w.Byte(DW_OP_const4u);
+			w.U32((uint32_t)row.ra);
+		}
+
+		for (int reg = 0; reg < 8; reg++)
+		{
+			if (reg == DW_REG_ESP)
+				continue;
+
+			if (!prev || row.saved[reg] != prev->saved[reg])
+				WriteRegisterRule(w, reg, row.saved[reg]);
+		}
+
+		prev = &row;
+	}
+
+	w.Align(4, DW_CFA_nop);
+	w.PatchLength(fde);
+
+	// Terminator
+	w.U32(0);
+}
+
+enum
+{
+	Section_Null,
+	Section_Text,
+	Section_EhFrame,
+	Section_SymTab,
+	Section_StrTab,
+	Section_ShStrTab,
+
+	Section_Count
+};
+
+static void BuildElf(std::vector<uint8_t> &out, const void *code, size_t size, const char *name, const std::vector<UnwindRow> &rows)
+{
+	Writer w;
+	Elf32_Shdr sections[Section_Count] = {};
+
+	Elf32_Ehdr ehdr = {};
+	memcpy(ehdr.e_ident, ELFMAG, SELFMAG);
+	ehdr.e_ident[EI_CLASS] = ELFCLASS32;
+	ehdr.e_ident[EI_DATA] = ELFDATA2LSB;
+	ehdr.e_ident[EI_VERSION] = EV_CURRENT;
+	ehdr.e_ident[EI_OSABI] = ELFOSABI_SYSV;
+	ehdr.e_type = ET_REL;
+	ehdr.e_machine = EM_386;
+	ehdr.e_version = EV_CURRENT;
+	ehdr.e_ehsize = sizeof(Elf32_Ehdr);
+	ehdr.e_shentsize = sizeof(Elf32_Shdr);
+	ehdr.e_shnum = Section_Count;
+	ehdr.e_shstrndx = Section_ShStrTab;
+	w.Bytes(&ehdr, sizeof(ehdr));
+
+	Writer shstrtab;
+	shstrtab.Byte(0);
+	auto section = [&sections, &shstrtab](int index, const char *name, uint32_t type, uint32_t flags)
+	{
+		sections[index].sh_name = (uint32_t)shstrtab.Size();
+		sections[index].sh_type = type;
+		sections[index].sh_flags = flags;
+		shstrtab.String(name);
+	};
+
+	// The code itself isn't in the object, only where it is
+	section(Section_Text, ".text", SHT_NOBITS, SHF_ALLOC | SHF_EXECINSTR);
+	sections[Section_Text].sh_addr = (Elf32_Addr)(uintptr_t)code;
+	sections[Section_Text].sh_size = (uint32_t)size;
+	sections[Section_Text].sh_addralign = 16;
+
+	section(Section_EhFrame, ".eh_frame", SHT_PROGBITS, SHF_ALLOC);
+	w.Align(4, 0);
+	sections[Section_EhFrame].sh_offset = (uint32_t)w.Size();
+	WriteEhFrame(w, size, rows);
+	sections[Section_EhFrame].sh_size = (uint32_t)(w.Size() - sections[Section_EhFrame].sh_offset);
+	sections[Section_EhFrame].sh_addralign = 4;
+
+	Writer strtab;
+	strtab.Byte(0);
+	uint32_t symname = (uint32_t)strtab.Size();
+	strtab.String(name);
+
+	section(Section_SymTab, ".symtab", SHT_SYMTAB, 0);
+	w.Align(4, 0);
+	sections[Section_SymTab].sh_offset = (uint32_t)w.Size();
+	Elf32_Sym syms[2] = {};
+	syms[1].st_name = symname;
+	syms[1].st_value = 0;
+	syms[1].st_size = (uint32_t)size;
+	syms[1].st_info = ELF32_ST_INFO(STB_GLOBAL, STT_FUNC);
+	syms[1].st_shndx = Section_Text;
+	w.Bytes(syms, sizeof(syms));
+	sections[Section_SymTab].sh_size = sizeof(syms);
+	sections[Section_SymTab].sh_link = Section_StrTab;
+	// Index of the first global
+	sections[Section_SymTab].sh_info = 1;
+	sections[Section_SymTab].sh_entsize = sizeof(Elf32_Sym);
+	sections[Section_SymTab].sh_addralign = 4;
+
+	section(Section_StrTab, ".strtab", SHT_STRTAB, 0);
+	sections[Section_StrTab].sh_offset = (uint32_t)w.Size();
+	sections[Section_StrTab].sh_size = (uint32_t)strtab.Size();
+	sections[Section_StrTab].sh_addralign = 1;
+	w.Bytes(strtab.Buffer().data(), strtab.Size());
+
+	section(Section_ShStrTab, ".shstrtab", SHT_STRTAB, 0);
+	sections[Section_ShStrTab].sh_offset = (uint32_t)w.Size();
+	sections[Section_ShStrTab].sh_size = (uint32_t)shstrtab.Size();
+	sections[Section_ShStrTab].sh_addralign = 1;
+	w.Bytes(shstrtab.Buffer().data(), shstrtab.Size());
+
+	w.Align(4, 0);
+	ehdr.e_shoff = (uint32_t)w.Size();
+	w.Patch(0, ehdr);
+	w.Bytes(sections, sizeof(sections));
+
+	out.swap(w.Buffer());
+}
+
+void GdbJitAdd(const void *code, size_t size, const char *name, const std::vector<UnwindRow> &rows)
+{
+	GdbJitRemove(code);
+
+	JitObject *object = new JitObject();
+	BuildElf(object->elf, code, size, name, rows);
+	object->entry.symfile_addr = (const char *)object->elf.data();
+	object->entry.symfile_size = object->elf.size();
+	s_Objects[code] = object;
+
+	object->entry.next_entry = __jit_debug_descriptor.first_entry;
+	if (object->entry.next_entry)
+		object->entry.next_entry->prev_entry = &object->entry;
+	__jit_debug_descriptor.first_entry = &object->entry;
+
+	__jit_debug_descriptor.relevant_entry = &object->entry;
+	__jit_debug_descriptor.action_flag = JIT_REGISTER_FN;
+	__jit_debug_register_code();
+}
+
+void GdbJitRemove(const void *code)
+{
+	auto it = s_Objects.find(code);
+	if (it == s_Objects.end())
+		return;
+
+	JitObject *object = it->second;
+	s_Objects.erase(it);
+
+	jit_code_entry *entry = &object->entry;
+	if (entry->prev_entry)
+		entry->prev_entry->next_entry = entry->next_entry;
+	else
+		__jit_debug_descriptor.first_entry = entry->next_entry;
+	if (entry->next_entry)
+		entry->next_entry->prev_entry = entry->prev_entry;
+
+	__jit_debug_descriptor.relevant_entry = entry;
+	__jit_debug_descriptor.action_flag = JIT_UNREGISTER_FN;
+	__jit_debug_register_code();
+
+	delete object;
+}
+
+void GdbJitRemoveAll()
+{
+	while (!s_Objects.empty())
+		GdbJitRemove(s_Objects.begin()->first);
+}
+
+#else
+
+void GdbJitAdd(const void *code, size_t size, const char *name, const std::vector<UnwindRow> &rows)
+{
+}
+
+void GdbJitRemove(const void *code)
+{
+}
+
+void GdbJitRemoveAll()
+{
+}
+
+#endif
@@ -0,0 +1,27 @@
+#pragma once
+
+#include "extension.h"
+#include <vector>
+
+// How to get back to the hooked code from a point in a stub
+// Everything we generate runs in place of the hooked code, with its frame
+// still on the stack, so the "caller" of a stub is the hooked function
+// itself, at the instruction the stub stands in for
+struct UnwindRow
+{
+	// From the start of the stub
+	uint32_t pc;
+	// Bytes pushed since entering the stub, esp + cfa is the hooked code's esp
+	uint32_t cfa;
+	// The hooked instruction this point stands in for
+	uintptr_t ra;
+	// GPRs by encoding, saved at esp + cfa - saved[n], or 0 if they're in the register
+	uint32_t saved[8];
+};
+
+// Registers stubs with GDB's JIT interface as in-memory ELF objects, with a
+// symbol and .eh_frame each, so debuggers and crash reporters can unwind through
+// hooks. A no-op off of Linux
+void GdbJitAdd(const void *code, size_t size, const char *name, const std::vector<UnwindRow> &rows);
+void GdbJitRemove(const void *code);
+void GdbJitRemoveAll();
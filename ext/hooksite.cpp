@@ -0,0 +1,827 @@
+#include "hooksite.h"
+#include "midhook.h"
+#include "modules.h"
+#include "perfmap.h"
+#include "gdbjit.h"
+#include "span.h"
+
+#include "asm/asm.h"
+#include "CDetour/detourhelpers.h"
+
+HookSite::Grave HookSite::s_Graves[2];
+bool HookSite::s_Batching = false;
+std::vector<HookSite *> HookSite::s_Batch;
+std::vector<HookSite::Slot *> HookSite::s_Orphans;
+
+HookSite *HookSite::Create(void *target)
+{
+	HookSite *site = new HookSite();
+	site->m_Target = (uint8_t *)target;
+	site->Snapshot();
+	return site;
+}
+
+void HookSite::Snapshot()
+{
+	m_ByteLen = copy_bytes(m_Target, nullptr, OP_JMP_SIZE);
+	memcpy(m_Original, m_Target, m_ByteLen);
+
+	// copy_bytes of 1 byte is exactly one instruction
+	m_Boundaries.clear();
+	for (int offset = 0; offset < m_ByteLen; offset += copy_bytes(m_Target + offset, nullptr, 1))
+		m_Boundaries.push_back(offset);
+
+	// Someone else's detour, we can hop straight to wherever it goes
+	m_Chain = nullptr;
+	if (m_Target[0] == OP_JMP && m_ByteLen == OP_JMP_SIZE)
+		m_Chain = eval_jump(m_Target);
+}
+
+HookSite::~HookSite()
+{
+	Unbuild();
+
+	for (Slot *slot : m_Slots)
+		s_Graves[0].slots.push_back(slot);
+}
+
+bool HookSite::IsBoundary(const void *addr)
+{
+	int offset = (int)((const uint8_t *)addr - m_Target);
+	return std::find(m_Boundaries.begin(), m_Boundaries.end(), offset) != m_Boundaries.end();
+}
+
+bool HookSite::Attach(MidHook *hook, char *error, size_t maxlen)
+{
+	if (!IsBoundary(hook->Target()))
+	{
+		snprintf(error, maxlen, "Address %p is in the middle of an instruction that was relocated for the hook at %p", hook->Target(), m_Target);
+		return false;
+	}
+
+	int offset = (int)((uint8_t *)hook->Target() - m_Target);
+	auto it = std::lower_bound(m_Slots.begin(), m_Slots.end(), offset, [](Slot *slot, int offset)
+	{
+		return slot->offset < offset;
+	});
+
+	// Already a bridge here, so it's just one more callback to dispatch
+	if (it != m_Slots.end() && (*it)->offset == offset)
+	{
+		Slot *slot = *it;
+		bool compact = slot->hooks.size() == 1 && (slot->hooks[0]->Counter() || slot->hooks[0]->Span());
+		slot->hooks.push_back(hook);
+		if (!compact)
+			return true;
+
+		// Unless it's a counter's or a span end's, which don't dispatch anything
+		Unbuild();
+		if (IsBoundary(hook->Target()) && Build(error, maxlen))
+			return true;
+
+		// Orphaning may have dropped the slot, hook and all
+		for (Slot *other : m_Slots)
+		{
+			auto pos = std::find(other->hooks.begin(), other->hooks.end(), hook);
+			if (pos != other->hooks.end())
+				other->hooks.erase(pos);
+		}
+
+		if (!IsBoundary(hook->Target()))
+			snprintf(error, maxlen, "Address %p is in the middle of an instruction that was relocated for the hook at %p", hook->Target(), m_Target);
+		Rebuild();
+		return false;
+	}
+
+	// Tearing down first may find we've been patched over, and the
+	// window we're rebuilding from is no longer the one we checked
+	Unbuild();
+	if (!IsBoundary(hook->Target()))
+	{
+		snprintf(error, maxlen, "Address %p is in the middle of an instruction that was relocated for the hook at %p", hook->Target(), m_Target);
+		Rebuild();
+		return false;
+	}
+
+	Slot *slot = new Slot();
+	slot->offset = offset;
+	slot->hooks.push_back(hook);
+	m_Slots.insert(std::lower_bound(m_Slots.begin(), m_Slots.end(), offset, [](Slot *slot, int offset)
+	{
+		return slot->offset < offset;
+	}), slot);
+
+	if (!Build(error, maxlen))
+	{
+		m_Slots.erase(std::find(m_Slots.begin(), m_Slots.end(), slot));
+		delete slot;
+
+		Rebuild();
+		return false;
+	}
+	return true;
+}
+
+bool HookSite::Detach(MidHook *hook)
+{
+	for (auto it = m_Slots.begin(); it != m_Slots.end(); ++it)
+	{
+		Slot *slot = *it;
+		auto pos = std::find(slot->hooks.begin(), slot->hooks.end(), hook);
+		if (pos == slot->hooks.end())
+			continue;
+
+		if (slot->counter == hook)
+			FoldHits(slot);
+
+		slot->hooks.erase(pos);
+		if (!slot->hooks.empty())
+			return false;
+
+		// Last one out, this boundary no longer needs a bridge
+		m_Slots.erase(it);
+		s_Graves[0].slots.push_back(slot);
+
+		Unbuild();
+		Rebuild();
+		return m_Slots.empty();
+	}
+	return m_Slots.empty();
+}
+
+bool HookSite::Build(char *error, size_t maxlen)
+{
+	// Segments of the relocated window start at 0 and at every hooked boundary
+	std::vector<int> starts;
+	starts.push_back(0);
+	for (Slot *slot : m_Slots)
+	{
+		if (slot->offset != 0)
+			starts.push_back(slot->offset);
+	}
+
+	// Emit back to front, each piece needs to know where it jumps to
+	void *next = m_Target + m_ByteLen;
+	auto slot = m_Slots.rbegin();
+	for (int i = (int)starts.size() - 1; i >= 0; i--)
+	{
+		int begin = starts[i];
+		int len = (i + 1 < (int)starts.size() ? starts[i + 1] : m_ByteLen) - begin;
+
+		// The whole window is a jmp, no need to relocate it just to take it
+		if (m_Chain)
+			next = m_Chain;
+		else if (!EmitSegment(begin, len, &next))
+		{
+			snprintf(error, maxlen, "Could not allocate trampoline for MidHook at %p", m_Target + begin);
+			FreeCode();
+			return false;
+		}
+
+		if (slot != m_Slots.rend() && (*slot)->offset == begin)
+		{
+			next = EmitBridge(*slot, next);
+			if (!next)
+			{
+				snprintf(error, maxlen, "Could not allocate bridge for MidHook at %p", m_Target + begin);
+				FreeCode();
+				return false;
+			}
+			++slot;
+		}
+	}
+
+	// Written out with the rest of the batch, see EndBatch
+	if (s_Batching)
+	{
+		inject_jmp_at(m_Patch, m_Target, next);
+		if (m_ByteLen - OP_JMP_SIZE > 0)
+			memset(m_Patch + OP_JMP_SIZE, 0x90, m_ByteLen - OP_JMP_SIZE);
+
+		s_Batch.push_back(this);
+		m_Deferred = true;
+		m_Built = true;
+		return true;
+	}
+
+	// Emplace the bridge
+	DoGatePatch(m_Target, next);
+
+	// Memset nops after because permissions are set in DoGatePatch
+	if (m_ByteLen - OP_JMP_SIZE > 0)
+		memset(m_Target + OP_JMP_SIZE, 0x90, m_ByteLen - OP_JMP_SIZE);
+
+	memcpy(m_Patch, m_Target, m_ByteLen);
+	m_Built = true;
+	return true;
+}
+
+void HookSite::Rebuild()
+{
+	if (m_Slots.empty())
+		return;
+
+	char error[256];
+	if (Build(error, sizeof(error)))
+		return;
+
+	smutils->LogError(myself, "Could not rebuild hook at %p: %s", m_Target, error);
+
+	// Nothing of ours is patched in, so none of the hooks here are enabled
+	for (Slot *slot : m_Slots)
+	{
+		for (MidHook *hook : slot->hooks)
+			hook->m_Site = nullptr;
+		s_Graves[0].slots.push_back(slot);
+	}
+	m_Slots.clear();
+}
+
+bool HookSite::EmitSegment(int begin, int len, void **next)
+{
+	CodeBlock segment;
+	if (!g_ExecAllocator->Alloc(len + OP_JMP_SIZE, m_Target, &segment))
+		return false;
+
+	m_Code.push_back({segment.exec, (size_t)len + OP_JMP_SIZE, begin, false});
+
+	// Relocation keeps every instruction the same length, so each one is
+	// where it was in the window, just moved
+	std::vector<UnwindRow> rows;
+	for (int offset : m_Boundaries)
+	{
+		if (offset >= begin && offset < begin + len)
+			rows.push_back({(uint32_t)(offset - begin), 0, (uintptr_t)(m_Target + offset), {}});
+	}
+	// The jmp out
+	rows.push_back({(uint32_t)len, 0, (uintptr_t)(m_Target + begin + len), {}});
+
+	copy_bytes_at(m_Target + begin, (unsigned char *)segment.write, (unsigned char *)segment.exec, len);
+	inject_jmp_at((unsigned char *)segment.write + len, (unsigned char *)segment.exec + len, *next);
+	*next = segment.exec;
+
+	// Only now, jitdump keeps a copy of the code
+	Describe(m_Code.back(), rows);
+	return true;
+}
+
+void HookSite::Unbuild()
+{
+	if (!m_Built)
+		return;
+
+	m_Built = false;
+
+	for (Slot *slot : m_Slots)
+		FoldHits(slot);
+
+	// Never patched in, so there's nothing to restore
+	if (m_Deferred)
+	{
+		m_Deferred = false;
+		s_Batch.erase(std::find(s_Batch.begin(), s_Batch.end(), this));
+		FreeCode();
+		return;
+	}
+
+	if (memcmp(m_Target, m_Patch, m_ByteLen))
+	{
+		smutils->LogError(myself, "Hook at %p was patched over by something else, leaving its code in place", m_Target);
+		Orphan();
+		return;
+	}
+
+	memcpy(m_Target, m_Original, m_ByteLen);
+	FreeCode();
+}
+
+void HookSite::FoldHits(Slot *slot)
+{
+	if (!slot->counter)
+		return;
+
+	slot->counter->m_Hits += slot->hits;
+	if (slot->timings)
+		slot->counter->m_Span->Fold(*slot->timings);
+	slot->counter = nullptr;
+	slot->hits = 0;
+}
+
+uint64_t *HookSite::PendingHits(MidHook *hook)
+{
+	for (Slot *slot : m_Slots)
+	{
+		if (slot->counter == hook)
+			return &slot->hits;
+	}
+	return nullptr;
+}
+
+LatencyHistogram *HookSite::PendingTimings(MidHook *hook)
+{
+	for (Slot *slot : m_Slots)
+	{
+		if (slot->counter == hook)
+			return slot->timings;
+	}
+	return nullptr;
+}
+
+void HookSite::Orphan()
+{
+	// The orphaned bridges still point at the current slots, so hand them
+	// empty ones to dispatch forever and move our hooks to new slots
+	for (Slot *&slot : m_Slots)
+	{
+		Slot *fresh = new Slot();
+		fresh->offset = slot->offset;
+		fresh->hooks.swap(slot->hooks);
+		s_Orphans.push_back(slot);
+		slot = fresh;
+	}
+	m_Code.clear();
+
+	// Whatever is there now is what we hook (and restore) from here on
+	Snapshot();
+
+	for (auto it = m_Slots.begin(); it != m_Slots.end();)
+	{
+		Slot *slot = *it;
+		if (IsBoundary(m_Target + slot->offset))
+		{
+			++it;
+			continue;
+		}
+
+		smutils->LogError(myself, "Hook at %p no longer lands on an instruction, disabling it", m_Target + slot->offset);
+		for (MidHook *hook : slot->hooks)
+			hook->m_Site = nullptr;
+
+		it = m_Slots.erase(it);
+		delete slot;
+	}
+}
+
+void HookSite::Describe(const Stub &stub, const std::vector<UnwindRow> &rows)
+{
+	// Nothing runs in it until the batch is patched in, see EndBatch
+	if (s_Batching)
+	{
+		m_Undescribed.push_back({(size_t)(&stub - m_Code.data()), rows});
+		return;
+	}
+
+	// Named after whoever hooked its boundary, or for a trampoline that
+	// isn't at one, the first hook in the window
+	Slot *owner = m_Slots.front();
+	for (Slot *slot : m_Slots)
+	{
+		if (slot->offset == stub.offset)
+			owner = slot;
+	}
+
+	char location[256];
+	FormatAddress(m_Target + stub.offset, location, sizeof(location));
+
+	char name[512];
+	snprintf(name, sizeof(name), "midhook_%s:%s:%s", stub.bridge ? "bridge" : "trampoline",
+		owner->hooks.empty() ? "<none>" : owner->hooks.front()->OwnerName(), location);
+	PerfMapAdd(stub.exec, stub.size, name);
+	GdbJitAdd(stub.exec, stub.size, name, rows);
+}
+
+void HookSite::FreeCode()
+{
+	for (const Stub &stub : m_Code)
+	{
+		PerfMapRemove(stub.exec);
+		GdbJitRemove(stub.exec);
+		s_Graves[0].code.push_back(stub.exec);
+	}
+	m_Code.clear();
+	m_Undescribed.clear();
+}
+
+void *HookSite::EmitBridge(Slot *slot, void *next)
+{
+	if (slot->hooks.size() == 1 && slot->hooks[0]->Counter())
+		return EmitCounter(slot, next);
+	if (slot->hooks.size() == 1 && slot->hooks[0]->Span())
+		return EmitSpanEnd(slot, next);
+
+	MAssembler masm;
+
+	// Unwind info for each point the frame changes, see gdbjit.h
+	std::vector<UnwindRow> rows;
+	UnwindRow row = {0, 0, (uintptr_t)(m_Target + slot->offset), {}};
+	rows.push_back(row);
+
+	auto pushed = [&masm, &rows, &row](int bytes, const RegisterDesc *desc)
+	{
+		row.pc = (uint32_t)masm.length();
+		row.cfa += bytes;
+		if (desc && desc->cls == RegisterClass_GPR32 && desc->code != RegisterCode_ESP)
+			row.saved[desc->code] = row.cfa;
+		rows.push_back(row);
+	};
+
+	auto popped = [&masm, &rows, &row](int bytes, const RegisterDesc *desc)
+	{
+		row.pc = (uint32_t)masm.length();
+		row.cfa -= bytes;
+		if (desc && desc->cls == RegisterClass_GPR32 && desc->code != RegisterCode_ESP)
+			row.saved[desc->code] = 0;
+		rows.push_back(row);
+	};
+
+	// Push registers
+	// We push in reverse order of the HookRegisters structure so that
+	// it is properly set up since it will be used as a parameter
+	// esp is last in the frame, so it's pushed first and the true stack is held
+	// and can be manipulated
+	for (int i = (int)(sizeof(RegisterFrame) / sizeof(RegisterFrame[0])) - 1; i >= 0; i--)
+	{
+		masm.pushframe(RegisterFrame[i]);
+		pushed((int)RegisterSize(RegisterFrame[i].cls), &RegisterFrame[i]);
+	}
+
+	// Now that the registers are pushed/saved, we can work in the callback
+
+	// HookRegisters * param
+	masm.push(sp::esp);
+	pushed(sizeof(intptr_t), nullptr);
+	// Slot * param
+	masm.push((intptr_t)slot);
+	pushed(sizeof(intptr_t), nullptr);
+	masm.callrel((void *)&HookSite::Dispatch);
+	masm.addl(sp::esp, sizeof(intptr_t) * 2);
+	popped(sizeof(intptr_t) * 2, nullptr);
+
+	// Call is done and finished
+	// Since the HookRegisters param was on the stack,
+	// any modifications have already taken place
+	// So all that's left is to pop, then jmp to the
+	// trampoline
+	for (const RegisterDesc &desc : RegisterFrame)
+	{
+		masm.popframe(desc);
+		popped((int)RegisterSize(desc.cls), &desc);
+	}
+
+	// Jmp to trampoline
+	masm.jmprel(next);
+
+	return InstallBridge(masm, slot, rows);
+}
+
+void *HookSite::EmitCounter(Slot *slot, void *next)
+{
+	MAssembler masm;
+
+	std::vector<UnwindRow> rows;
+	UnwindRow row = {0, 0, (uintptr_t)(m_Target + slot->offset), {}};
+	rows.push_back(row);
+
+	masm.pushfd();
+	row.pc = (uint32_t)masm.length();
+	row.cfa = sizeof(intptr_t);
+	rows.push_back(row);
+
+	slot->counter = slot->hooks[0];
+	masm.incmem64(&slot->hits);
+
+	masm.popfd();
+	row.pc = (uint32_t)masm.length();
+	row.cfa = 0;
+	rows.push_back(row);
+
+	masm.jmprel(next);
+
+	return InstallBridge(masm, slot, rows);
+}
+
+void *HookSite::EmitSpanEnd(Slot *slot, void *next)
+{
+	MidHook *hook = slot->hooks[0];
+	HookSpan *span = hook->Span();
+	HookSpan::Stamp *stamp = span->LastStart();
+
+	MAssembler masm;
+
+	std::vector<UnwindRow> rows;
+	UnwindRow row = {0, 0, (uintptr_t)(m_Target + slot->offset), {}};
+	rows.push_back(row);
+
+	// Flags, then what rdtsc and the bucket math clobber
+	static const RegisterCode saved[] = {RegisterCode_EAX, RegisterCode_ECX, RegisterCode_EDX};
+	masm.pushfd();
+	row.pc = (uint32_t)masm.length();
+	row.cfa += sizeof(intptr_t);
+	rows.push_back(row);
+	for (RegisterCode code : saved)
+	{
+		masm.pushreg(code);
+		row.pc = (uint32_t)masm.length();
+		row.cfa += sizeof(intptr_t);
+		row.saved[code] = row.cfa;
+		rows.push_back(row);
+	}
+
+	slot->counter = hook;
+	masm.incmem64(&slot->hits);
+
+	if (!hook->SpanStop())
+	{
+		// The same as HookSpan::OnStart
+		masm.rdtsc();
+		masm.memop(0x89, RegisterCode_EAX, &stamp->tsc);
+		masm.memop(0x89, RegisterCode_EDX, (uint8_t *)&stamp->tsc + 4);
+		masm.movthreadself();
+		masm.memop(0x89, RegisterCode_EAX, &stamp->thread);
+		masm.movmem32(&stamp->generation, (int32_t)span->Generation());
+	}
+	else
+	{
+		// And HookSpan::OnStop, with LatencyHistogram::Record written out
+		if (!slot->timings)
+			slot->timings = new LatencyHistogram();
+		LatencyHistogram *stats = slot->timings;
+
+		// Nothing to record unless this span last started on this thread
+		masm.movthreadself();
+		masm.memop(0x3b, RegisterCode_EAX, &stamp->thread);
+		uint32_t otherthread = masm.jrel32(0x85);
+		masm.cmpmem32(&stamp->generation, (int32_t)span->Generation());
+		uint32_t stale = masm.jrel32(0x85);
+		masm.movmem32(&stamp->generation, 0);
+
+		// edx:eax = rdtsc - tsc
+		masm.rdtsc();
+		masm.memop(0x2b, RegisterCode_EAX, &stamp->tsc);
+		masm.memop(0x1b, RegisterCode_EDX, (uint8_t *)&stamp->tsc + 4);
+
+		masm.incmem64(&stats->m_Count);
+		// add [total], eax
+		// adc [total + 4], edx
+		masm.memop(0x01, RegisterCode_EAX, &stats->m_Total);
+		masm.memop(0x11, RegisterCode_EDX, (uint8_t *)&stats->m_Total + 4);
+
+		// Unsigned 64-bit compare against max, high halves first
+		masm.memop(0x3b, RegisterCode_EDX, (uint8_t *)&stats->m_Max + 4);
+		uint32_t below = masm.jrel8(0x72);
+		uint32_t above = masm.jrel8(0x77);
+		masm.memop(0x3b, RegisterCode_EAX, &stats->m_Max);
+		uint32_t notabove = masm.jrel8(0x76);
+		masm.bindrel8(above);
+		masm.memop(0x89, RegisterCode_EAX, &stats->m_Max);
+		masm.memop(0x89, RegisterCode_EDX, (uint8_t *)&stats->m_Max + 4);
+		masm.bindrel8(below);
+		masm.bindrel8(notabove);
+
+		// Bucket into eax, see LatencyHistogram::Bucket
+		// Below LINEAR it's the value itself
+		static_assert(LatencyHistogram::SUB_BITS == 2 && LatencyHistogram::LINEAR == 16, "Bucket math below is for 2 sub bits");
+		// test edx, edx
+		masm.writebyte(0x85);
+		masm.writebyte(0xd2);
+		uint32_t high = masm.jrel8(0x75);
+		// cmp eax, 16
+		masm.writebyte(0x83);
+		masm.writebyte(0xf8);
+		masm.writebyte(LatencyHistogram::LINEAR);
+		uint32_t linear = masm.jrel8(0x72);
+		// bsr ecx, eax
+		masm.writebyte(0x0f);
+		masm.writebyte(0xbd);
+		masm.writebyte(0xc8);
+		uint32_t low = masm.jrel8(0xeb);
+		masm.bindrel8(high);
+		// bsr ecx, edx
+		// add ecx, 32
+		masm.writebyte(0x0f);
+		masm.writebyte(0xbd);
+		masm.writebyte(0xca);
+		masm.writebyte(0x83);
+		masm.writebyte(0xc1);
+		masm.writebyte(32);
+		masm.bindrel8(low);
+
+		// ecx = exp - 2, eax = (value >> ecx) & 3
+		// sub ecx, 2
+		// cmp ecx, 32
+		masm.writebyte(0x83);
+		masm.writebyte(0xe9);
+		masm.writebyte(2);
+		masm.writebyte(0x83);
+		masm.writebyte(0xf9);
+		masm.writebyte(32);
+		uint32_t shrd = masm.jrel8(0x72);
+		// mov eax, edx
+		// shr eax, cl (the count is taken mod 32)
+		masm.writebyte(0x89);
+		masm.writebyte(0xd0);
+		masm.writebyte(0xd3);
+		masm.writebyte(0xe8);
+		uint32_t shifted = masm.jrel8(0xeb);
+		masm.bindrel8(shrd);
+		// shrd eax, edx, cl
+		masm.writebyte(0x0f);
+		masm.writebyte(0xad);
+		masm.writebyte(0xd0);
+		masm.bindrel8(shifted);
+		// and eax, 3
+		// lea eax, [eax + ecx * 4 + 8], LINEAR + (exp - 4) * 4 + sub
+		masm.writebyte(0x83);
+		masm.writebyte(0xe0);
+		masm.writebyte(3);
+		masm.writebyte(0x8d);
+		masm.writebyte(0x44);
+		masm.writebyte(0x88);
+		masm.writebyte(8);
+		masm.bindrel8(linear);
+
+		// add dword [buckets + eax * 8], 1
+		// adc dword [buckets + eax * 8 + 4], 0
+		masm.writebyte(0x83);
+		masm.writebyte(0x04);
+		masm.writebyte(0xc5);
+		masm.writeint32((int32_t)(intptr_t)stats->m_Buckets);
+		masm.writebyte(1);
+		masm.writebyte(0x83);
+		masm.writebyte(0x14);
+		masm.writebyte(0xc5);
+		masm.writeint32((int32_t)((intptr_t)stats->m_Buckets + 4));
+		masm.writebyte(0);
+
+		masm.bindrel32(otherthread);
+		masm.bindrel32(stale);
+	}
+
+	for (int i = (int)(sizeof(saved) / sizeof(saved[0])) - 1; i >= 0; i--)
+	{
+		masm.popreg(saved[i]);
+		row.pc = (uint32_t)masm.length();
+		row.cfa -= sizeof(intptr_t);
+		row.saved[saved[i]] = 0;
+		rows.push_back(row);
+	}
+	masm.popfd();
+	row.pc = (uint32_t)masm.length();
+	row.cfa -= sizeof(intptr_t);
+	rows.push_back(row);
+
+	masm.jmprel(next);
+
+	return InstallBridge(masm, slot, rows);
+}
+
+void *HookSite::InstallBridge(MAssembler &masm, Slot *slot, const std::vector<UnwindRow> &rows)
+{
+	CodeBlock bridge;
+	if (!g_ExecAllocator->Alloc(masm.length(), m_Target, &bridge))
+		return nullptr;
+
+	masm.emit(bridge);
+	m_Code.push_back({bridge.exec, (size_t)masm.length(), slot->offset, true});
+	Describe(m_Code.back(), rows);
+	return bridge.exec;
+}
+
+// Whether hook is still attached to slot, without touching hook
+static bool Attached(HookSite::Slot *slot, MidHook *hook)
+{
+	return std::find(slot->hooks.begin(), slot->hooks.end(), hook) != slot->hooks.end();
+}
+
+void HookSite::Dispatch(Slot *slot, MidHookRegisters *regs)
+{
+	// Callbacks can attach and detach hooks here, so walk the hooks as they
+	// were on entry and pass over any that have been detached (and maybe
+	// freed) since. Ones attached since wait for the next hit
+	// The slot itself outlives this, see s_Graves
+	MidHook *fixed[8];
+	std::vector<MidHook *> spill;
+	MidHook **hooks = fixed;
+	size_t count = slot->hooks.size();
+	if (count > sizeof(fixed) / sizeof(fixed[0]))
+	{
+		spill = slot->hooks;
+		hooks = spill.data();
+	}
+	else
+		std::copy(slot->hooks.begin(), slot->hooks.end(), fixed);
+
+	// Hooks that went over budget, demoted once the walk is done so that
+	// disabling them doesn't rebuild the slot under it
+	MidHook *over[8];
+	size_t numover = 0;
+
+	for (size_t i = 0; i < count; i++)
+	{
+		MidHook *hook = hooks[i];
+		if (i && !Attached(slot, hook))
+			continue;
+
+		if (!g_Profiling && !hook->Budgeted())
+		{
+			MidHook::CallbackHandler(hook, regs);
+			continue;
+		}
+
+		uint64_t start = Timestamp();
+		MidHook::CallbackHandler(hook, regs);
+		uint64_t cycles = Timestamp() - start;
+
+		// The callback may have removed, and freed, its own hook
+		if (!Attached(slot, hook))
+			continue;
+
+		if (g_Profiling)
+			hook->RecordLatency(cycles);
+		if (hook->Budgeted() && hook->ChargeBudget(cycles) && numover < sizeof(over) / sizeof(over[0]))
+			over[numover++] = hook;
+	}
+
+	// Still inside the bridge, so whatever this frees goes to the graveyard
+	// Each can call into its plugin, which may free any of the others
+	for (size_t i = 0; i < numover; i++)
+	{
+		if (Attached(slot, over[i]))
+			over[i]->OverBudget();
+	}
+}
+
+void HookSite::Bury(Grave &grave)
+{
+	for (void *code : grave.code)
+		g_ExecAllocator->Free(code);
+	grave.code.clear();
+
+	for (Slot *slot : grave.slots)
+		delete slot;
+	grave.slots.clear();
+}
+
+void HookSite::OnGameFrame(bool simulating)
+{
+	// Whatever was torn down a frame ago has had a whole frame for any
+	// thread in it to get out, including calls made from relocated code
+	Bury(s_Graves[1]);
+	std::swap(s_Graves[0], s_Graves[1]);
+}
+
+void HookSite::BeginBatch()
+{
+	s_Batching = true;
+}
+
+void HookSite::EndBatch()
+{
+	s_Batching = false;
+
+	std::sort(s_Batch.begin(), s_Batch.end(), [](HookSite *a, HookSite *b)
+	{
+		return a->m_Target < b->m_Target;
+	});
+
+	// Made writable a page at a time rather than a patch at a time
+	const uintptr_t pagesize = 4096;
+	for (size_t first = 0; first < s_Batch.size();)
+	{
+		uintptr_t page = (uintptr_t)s_Batch[first]->m_Target & ~(pagesize - 1);
+		size_t last = first;
+		while (last + 1 < s_Batch.size() && ((uintptr_t)s_Batch[last + 1]->m_Target & ~(pagesize - 1)) == page)
+			last++;
+
+		HookSite *end = s_Batch[last];
+		SetMemPatchable(s_Batch[first]->m_Target, end->m_Target + end->m_ByteLen - s_Batch[first]->m_Target);
+
+		for (; first <= last; first++)
+		{
+			HookSite *site = s_Batch[first];
+			memcpy(site->m_Target, site->m_Patch, site->m_ByteLen);
+			site->m_Deferred = false;
+
+			for (const auto &pending : site->m_Undescribed)
+				site->Describe(site->m_Code[pending.first], pending.second);
+			site->m_Undescribed.clear();
+		}
+	}
+	s_Batch.clear();
+}
+
+void HookSite::StartGraveyard()
+{
+	smutils->AddGameFrameHook(&HookSite::OnGameFrame);
+}
+
+void HookSite::StopGraveyard()
+{
+	smutils->RemoveGameFrameHook(&HookSite::OnGameFrame);
+}
+
+void HookSite::FlushGraveyard()
+{
+	Bury(s_Graves[0]);
+	Bury(s_Graves[1]);
+}
@@ -0,0 +1,159 @@
+#pragma once
+
+#include "extension.h"
+#include "execmem.h"
+#include "gdbjit.h"
+#include "stats.h"
+#include <vector>
+
+class MidHook;
+class MAssembler;
+struct MidHookRegisters;
+
+// A patched address and the code generated for it
+// The site owns the patch window [target, target + bytelen), i.e. our jmp plus
+// whatever instructions it cut into. Every MidHook whose address falls on an
+// instruction boundary inside the window is attached to the site instead of
+// patching on top of it. Each boundary that has hooks gets its own bridge, and
+// the relocated instructions are split into segments between them, so each
+// hook's callback still runs right before the instruction it asked for:
+//
+// target: jmp entry
+// entry = bridge(0) -> segment [0, b1) -> bridge(b1) -> segment [b1, b2) -> ... -> target + bytelen
+//
+// If the target already starts with a jmp rel32 (another extension's detour),
+// the window is just that jmp, and the bridge jumps straight to where it went
+// rather than through a relocated copy of it
+// Before restoring anything we check that the bytes there are still the ones
+// we wrote. If another detour library patched over us since, restoring would
+// clobber it, so our code is left in place for it to keep jumping to
+class HookSite
+{
+public:
+	// Hooks attached at one instruction boundary
+	struct Slot
+	{
+		int offset;
+		std::vector<MidHook *> hooks;
+		// With a counter's bridge, the hook it counts for and the hits since
+		// it was built, folded back into the hook when the bridge goes away
+		// The count lives here so orphaned code has somewhere to keep writing
+		MidHook *counter;
+		uint64_t hits;
+		// With a span stop's bridge, the times it recorded, folded the same way
+		LatencyHistogram *timings;
+
+		~Slot() { delete timings; }
+	};
+
+	// A piece of generated code
+	struct Stub
+	{
+		void *exec;
+		size_t size;
+		// Where in the window its slot is, or its relocated instructions start
+		int offset;
+		bool bridge;
+	};
+
+	static HookSite *Create(void *target);
+	~HookSite();
+
+	bool Attach(MidHook *hook, char *error, size_t maxlen);
+	// Returns true if the site is empty afterwards
+	bool Detach(MidHook *hook);
+
+	void *Target() { return m_Target; }
+	int ByteLen() { return m_ByteLen; }
+	bool Empty() { return m_Slots.empty(); }
+	bool Contains(const void *addr) { return addr >= m_Target && addr < m_Target + m_ByteLen; }
+	bool IsBoundary(const void *addr);
+	const std::vector<Stub> &Stubs() { return m_Code; }
+	// Hits a counter's or span end's bridge has counted for hook that it doesn't know about yet
+	uint64_t *PendingHits(MidHook *hook);
+	// Same for the times a span stop's bridge has recorded
+	LatencyHistogram *PendingTimings(MidHook *hook);
+
+	// Code and slots can be torn down while something is still running in
+	// them, from inside a callback or from a call the relocated instructions
+	// made that has yet to return, so they're only freed a frame later
+	static void StartGraveyard();
+	static void StopGraveyard();
+	// Frees all of it now, for when nothing can be running in it anymore
+	static void FlushGraveyard();
+
+	// Sites built in between are patched in together at the end, grouped by
+	// page, and only then described to profilers and debuggers
+	// For attaching a lot of hooks at once, see BlockCoverage::Enable
+	static void BeginBatch();
+	static void EndBatch();
+
+	// Longest window a site can have, a jmp's worth of instructions, the last
+	// of which may be as long as x86 allows
+	static constexpr int MAX_WINDOW = 5 + 15 - 1;
+
+private:
+	HookSite() = default;
+
+	// Decode the window from whatever is at the target right now
+	void Snapshot();
+	bool Build(char *error, size_t maxlen);
+	void Unbuild();
+	// Build for the hooks that are left after a change to them
+	// If that fails, they're all dropped and the site is left empty
+	void Rebuild();
+	// Leave the current code to whoever patched over it
+	void Orphan();
+	// Hand a counter's or span end's bridge's hits (and times) to its hook
+	static void FoldHits(Slot *slot);
+	// Relocated instructions [begin, begin + len), then a jmp to *next
+	// *next is updated to point at the segment
+	bool EmitSegment(int begin, int len, void **next);
+	void *EmitBridge(Slot *slot, void *next);
+	// Bridge for a slot with only a counter, which bumps its hit count in place
+	void *EmitCounter(Slot *slot, void *next);
+	// Bridge for a slot with only a span end, which does HookSpan::OnStart or OnStop in place
+	void *EmitSpanEnd(Slot *slot, void *next);
+	// Copies masm's code to exec memory as a slot's bridge
+	void *InstallBridge(MAssembler &masm, Slot *slot, const std::vector<UnwindRow> &rows);
+	// For profilers and debuggers, see perfmap.h and gdbjit.h
+	void Describe(const Stub &stub, const std::vector<UnwindRow> &rows);
+	void FreeCode();
+
+	// Called from the bridges
+	static void Dispatch(Slot *slot, MidHookRegisters *regs);
+
+	// What was torn down within a frame
+	struct Grave
+	{
+		std::vector<void *> code;
+		std::vector<Slot *> slots;
+	};
+	static void Bury(Grave &grave);
+	static void OnGameFrame(bool simulating);
+
+	uint8_t *m_Target = {};
+	int m_ByteLen = {};
+	uint8_t m_Original[MAX_WINDOW] = {};
+	// What we wrote over it
+	uint8_t m_Patch[MAX_WINDOW] = {};
+	// Destination of the detour we found at the target, if any
+	void *m_Chain = {};
+	// Instruction start offsets within the window
+	std::vector<int> m_Boundaries;
+	// Sorted by offset
+	std::vector<Slot *> m_Slots;
+	std::vector<Stub> m_Code;
+	bool m_Built = {};
+	// Built in a batch, and waiting on EndBatch to be patched in
+	bool m_Deferred = {};
+	// Index into m_Code and unwind info, for the stubs Describe has put off
+	std::vector<std::pair<size_t, std::vector<UnwindRow>>> m_Undescribed;
+
+	// This frame's, then last frame's
+	static Grave s_Graves[2];
+	static bool s_Batching;
+	static std::vector<HookSite *> s_Batch;
+	// Slots of orphaned code, which is never freed
+	static std::vector<Slot *> s_Orphans;
+};
@@ -1,116 +1,38 @@
 #include "midhook.h"
+#include "registry.h"
+#include "trace.h"
+#include "span.h"
+#include "profiler.h"
+#include "modules.h"
 
-#include "asm/asm.h"
-#include "jit_helpers.h"
-#include "CDetour/detourhelpers.h"
+int MidHook::s_NextId = 1;
 
-std::vector<MidHook *> g_Hooks;
-
-MidHook::MidHook(void *ptr, IPluginFunction *callback, bool enable)
+MidHook::MidHook(void *ptr, IPluginFunction *callback, IPluginContext *owner, cell_t data)
 	: m_Target(ptr),
-	  m_Callback(callback)
+	  m_Callback(callback),
+	  m_Owner(owner),
+	  m_Data(data)
 {
-	if (enable)
-		Enable();
+	m_Id = s_NextId++;
 }
 
-bool MidHook::Enable()
+bool MidHook::Enable(char *error, size_t maxlen)
 {
 	if (Enabled())
 		return false;
 
-	// Create trampoline
-	m_ByteLen = copy_bytes((unsigned char *)m_Target, nullptr, OP_JMP_SIZE);
-	m_Trampoline = smutils->GetScriptingEngine()->AllocatePageMemory(m_ByteLen + OP_JMP_SIZE);
-	copy_bytes((unsigned char *)m_Target, (unsigned char *)m_Trampoline, OP_JMP_SIZE);
-	DoGatePatch((unsigned char *)m_Trampoline + m_ByteLen, (unsigned char *)m_Target + m_ByteLen);
-
-	// Create bridge
+	if (!m_Owner)
 	{
-		MAssembler masm;
-
-		// Push registers
-		// We push in reverse order of the HookRegisters structure so that
-		// it is properly set up since it will be used as a parameter
-
-		// esp is always pushed first (last in the struct) so that the true stack is held
-		// and can be manipulated
-		masm.push(sp::esp);
-
-		// Add any new registers here (in reverse order of their declaration)
-
-		masm.pushfd();
-		masm.pushmm(sp::xmm7);
-		masm.pushmm(sp::xmm6);
-		masm.pushmm(sp::xmm5);
-		masm.pushmm(sp::xmm4);
-		masm.pushmm(sp::xmm3);
-		masm.pushmm(sp::xmm2);
-		masm.pushmm(sp::xmm1);
-		masm.pushmm(sp::xmm0);
-		masm.push(sp::edi);
-		masm.push(sp::esi);
-		masm.push(sp::ebp);
-		masm.push(sp::ebx);
-		masm.push(sp::edx);
-		masm.push(sp::ecx);
-		masm.push(sp::eax);
-
-		// Now that the registers are pushed/saved, we can work in the callback
-
-		// HookRegisters * param
-		masm.push(sp::esp);
-		// MidHook * param
-		masm.push((intptr_t)this);
-		masm.call(ExternalAddress((void *)&MidHook::CallbackHandler));
-		masm.addl(sp::esp, sizeof(intptr_t) * 2);
-
-		// Call is done and finished
-		// Since the HookRegisters param was on the stack,
-		// any modifications have already taken place
-		// So all that's left is to pop, then jmp to the
-		// trampoline
-		masm.pop(sp::eax);
-		masm.pop(sp::ecx);
-		masm.pop(sp::edx);
-		masm.pop(sp::ebx);
-		masm.pop(sp::ebp);
-		masm.pop(sp::esi);
-		masm.pop(sp::edi);
-		masm.popmm(sp::xmm0);
-		masm.popmm(sp::xmm1);
-		masm.popmm(sp::xmm2);
-		masm.popmm(sp::xmm3);
-		masm.popmm(sp::xmm4);
-		masm.popmm(sp::xmm5);
-		masm.popmm(sp::xmm6);
-		masm.popmm(sp::xmm7);
-		masm.popfd();
-
-		// Add any new registers here
-
-		masm.pop(sp::esp);
-
-		// Jmp to trampoline
-		masm.jmp(ExternalAddress(m_Trampoline));
-
-		m_Bridge = smutils->GetScriptingEngine()->AllocatePageMemory(masm.length());
-		masm.emitToExecutableMemory(m_Bridge);
+		snprintf(error, maxlen, "The plugin that created the hook at %p has unloaded", m_Target);
+		return false;
 	}
 
-	// Emplace the bridge
-	DoGatePatch((unsigned char *)m_Target, m_Bridge);
-
-	// Memset nops after because permissions are set in DoGatePatch
-	if (m_ByteLen - OP_JMP_SIZE > 0)
-		memset((unsigned char *)m_Target + OP_JMP_SIZE, 0x90, m_ByteLen - OP_JMP_SIZE);
-
-	m_Enabled = true;
-	return true;
+	m_Site = g_Registry.Attach(this, error, maxlen);
+	return m_Site != nullptr;
 }
 
-// "Disable" basically means "free"
-// All the leg work is redone when the midhook is reenabled
+// The site is rebuilt (or restored, if we were the last one on it)
+// So all the leg work is redone when the midhook is reenabled
 // But maybe that isn't a bad thing if some stuff gets patched
 // while we're disabled
 bool MidHook::Disable()
@@ -118,65 +40,320 @@ bool MidHook::Disable()
 	if (!Enabled())
 		return false;
 
-	copy_bytes((unsigned char *)m_Trampoline, (unsigned char *)m_Target, m_ByteLen);
+	g_Registry.Detach(this, m_Site);
+	m_Site = nullptr;
+	return true;
+}
+
+void MidHook::Release()
+{
+	Disable();
+	ClearBudget();
+	m_Budget.forward = nullptr;
+	m_Callback = nullptr;
+	m_Owner = nullptr;
+}
+
+void MidHook::SetCallback(IPluginFunction *callback)
+{
+	m_Callback = callback;
+	m_ScopeName = nullptr;
+}
+
+bool MidHook::ValueSource::Init(DHookRegister reg, bool deref, int offset, int numbertype)
+{
+	int classes = deref ? (1 << RegisterClass_GPR32) : (1 << RegisterClass_GPR8) | (1 << RegisterClass_GPR32) | (1 << RegisterClass_XMM);
+	if (!LookupRegister(reg, classes))
+		return false;
+
+	this->reg = reg;
+	this->deref = deref;
+	this->offset = offset;
+	this->numbertype = numbertype;
+	return true;
+}
+
+cell_t MidHook::ValueSource::Read(MidHookRegisters *regs)
+{
+	// Partial reads only fill the low bytes
+	cell_t val = 0;
+	if (deref)
+		regs->Load(reg, offset, numbertype, &val);
+	else
+		regs->Get(reg, numbertype, &val);
+	return val;
+}
 
-	smutils->GetScriptingEngine()->FreePageMemory(m_Trampoline);
-	smutils->GetScriptingEngine()->FreePageMemory(m_Bridge);
-	m_Trampoline = nullptr;
-	m_Bridge = nullptr;
-	m_ByteLen = 0;
-	m_Enabled = false;
+bool MidHook::Watch(DHookRegister reg, bool deref, int offset, int numbertype)
+{
+	if (!m_Watch.source.Init(reg, deref, offset, numbertype))
+		return false;
+
+	m_Watch.active = true;
+	m_Watch.primed = false;
 	return true;
 }
 
-void MidHook::Cleanup()
+bool MidHook::Changed(MidHookRegisters *regs, cell_t *oldval, cell_t *newval)
+{
+	cell_t val = m_Watch.source.Read(regs);
+
+	bool changed = m_Watch.primed && val != m_Watch.last;
+	*oldval = m_Watch.last;
+	*newval = val;
+
+	m_Watch.last = val;
+	m_Watch.primed = true;
+	return changed;
+}
+
+bool MidHook::Aggregate(DHookRegister reg, bool deref, int offset, int numbertype, int capacity, bool exact, bool passthrough)
+{
+	if (!m_AggregateSource.Init(reg, deref, offset, numbertype))
+		return false;
+
+	// The sketch is only touched before the callback runs, so this is fine from one
+	delete m_Sketch;
+	m_Sketch = new ValueSketch(capacity, exact);
+	m_Passthrough = passthrough;
+	return true;
+}
+
+void MidHook::StopAggregating()
+{
+	delete m_Sketch;
+	m_Sketch = nullptr;
+}
+
+void MidHook::CollectStacks(int depth, int capacity, bool entry, bool passthrough)
+{
+	delete m_Stacks;
+	m_Stacks = new StackTable(depth, capacity, entry);
+	m_StacksPassthrough = passthrough;
+}
+
+void MidHook::StopCollectingStacks()
+{
+	delete m_Stacks;
+	m_Stacks = nullptr;
+}
+
+bool MidHook::Trace(uint32_t regmask, DHookRegister memreg, int memoffs, int memlen, bool passthrough)
+{
+	if (memlen && !LookupRegister(memreg, 1 << RegisterClass_GPR32))
+		return false;
+
+	m_Trace.regmask = regmask;
+	m_Trace.memreg = memreg;
+	m_Trace.memoffs = memoffs;
+	m_Trace.memlen = memlen;
+	m_Trace.passthrough = passthrough;
+	m_Trace.active = true;
+	return true;
+}
+
+void MidHook::TraceHit(MidHookRegisters *regs)
+{
+	cell_t values[MidHookReg_GPRCount];
+	regs->GetAll(values, false);
+
+	void *mem = nullptr;
+	if (m_Trace.memlen)
+		regs->Address(m_Trace.memreg, m_Trace.memoffs, &mem);
+
+	TraceRecord(m_Id, m_Trace.regmask, values, mem, m_Trace.memlen);
+}
+
+void MidHook::SetBudget(uint64_t cycles, MidHookBudgetPeriod period, MidHookBudgetAction action, int samplerate, Handle_t handle, IPluginFunction *forward)
 {
-	for (size_t i = 0; i < g_Hooks.size(); i++)
+	m_Budget.cycles = cycles;
+	m_Budget.spent = 0;
+	m_Budget.window = g_BudgetWindows[period];
+	m_Budget.period = period;
+	m_Budget.action = action;
+	m_Budget.samplerate = samplerate;
+	m_Budget.handle = handle;
+	m_Budget.forward = forward;
+}
+
+bool MidHook::ChargeBudget(uint64_t cycles)
+{
+	uint32_t window = g_BudgetWindows[m_Budget.period];
+	if (window != m_Budget.window)
 	{
-		delete g_Hooks.at(i);
+		m_Budget.window = window;
+		m_Budget.spent = 0;
 	}
-	g_Hooks.clear();
+
+	m_Budget.spent += cycles;
+	return m_Budget.spent > m_Budget.cycles;
 }
 
-void MidHook::Cleanup(IPluginContext *ctx)
+void MidHook::OverBudget()
 {
-	for (int i = (int)g_Hooks.size() - 1; i >= 0; --i)
+	// Sampling that didn't help leaves only disabling
+	MidHookBudgetAction action = m_Budget.action;
+	if (action == MidHookBudget_Sample && m_SampleRate >= m_Budget.samplerate)
+		action = MidHookBudget_Disable;
+
+	char target[256];
+	FormatAddress(m_Target, target, sizeof(target));
+	smutils->LogError(myself, "Hook %d at %s (%s) spent %llu cycles this %s, over its budget of %llu, %s", m_Id, target, OwnerName(),
+		(unsigned long long)m_Budget.spent, BudgetPeriodName(m_Budget.period), (unsigned long long)m_Budget.cycles,
+		action == MidHookBudget_Disable ? "disabling it" : "sampling it");
+
+	uint64_t spent = m_Budget.spent;
+	m_Budget.spent = 0;
+	if (action == MidHookBudget_Disable)
+		Disable();
+	else
+		SetSampleRate(m_Budget.samplerate);
+
+	// The plugin may well delete us
+	IPluginFunction *forward = m_Budget.forward;
+	if (forward)
 	{
-		MidHook *hook = g_Hooks.at(i);
-		if (hook->Callback()->GetParentContext() == ctx)
-		{
-			delete hook;
-			g_Hooks.erase(g_Hooks.begin() + i);
-		}
+		forward->PushCell(m_Budget.handle);
+		forward->PushCell((cell_t)std::min<uint64_t>(spent, INT32_MAX));
+		forward->PushCell(action);
+		forward->Execute(nullptr);
 	}
 }
 
-void MidHook::Cleanup(MidHook *hookToRemove)
+void MidHook::RecordLatency(uint64_t cycles)
+{
+	if (!m_Latency)
+		m_Latency = new LatencyHistogram();
+
+	m_Latency->Record(cycles);
+}
+
+uint64_t MidHook::Hits()
 {
-	for (int i = (int)g_Hooks.size() - 1; i >= 0; --i)
+	uint64_t *pending = (m_Counter || m_Span) && m_Site ? m_Site->PendingHits(this) : nullptr;
+	return m_Hits + (pending ? *pending : 0);
+}
+
+void MidHook::ResetStats()
+{
+	uint64_t *pending = (m_Counter || m_Span) && m_Site ? m_Site->PendingHits(this) : nullptr;
+	if (pending)
+		*pending = 0;
+
+	m_Hits = 0;
+	if (m_Latency)
+		m_Latency->Reset();
+}
+
+void *MidHook::ReturnAddress()
+{
+	if (!Enabled())
+		return nullptr;
+
+	return (unsigned char *)m_Site->Target() + m_Site->ByteLen();
+}
+
+const char *MidHook::OwnerName()
+{
+	if (!m_Owner)
+		return "<unloaded>";
+
+	IPlugin *plugin = plsys->FindPluginByContext(m_Owner->GetContext());
+	return plugin ? plugin->GetFilename() : "<unknown>";
+}
+
+const char *MidHook::ScopeName()
+{
+	if (!m_ScopeName)
 	{
-		MidHook *hook = g_Hooks.at(i);
-		if (hook == hookToRemove)
-		{
-			delete hook;
-			g_Hooks.erase(g_Hooks.begin() + i);
-			return;
-		}
+		char target[256];
+		FormatSymbol(m_Target, target, sizeof(target));
+
+		char name[PLATFORM_MAX_PATH + 256];
+		snprintf(name, sizeof(name), "%s:%s", OwnerName(), target);
+		m_ScopeName = InternScopeName(name);
 	}
+	return m_ScopeName;
 }
 
 MidHook::~MidHook()
 {
 	Disable();
+	delete m_Sketch;
+	delete m_Stacks;
+	delete m_Latency;
 }
 
 volatile void MidHook::CallbackHandler(MidHook *hook, MidHookRegisters *regs)
 {
 	// Any set/load natives immediately update stored registers
 	// So any errors/exceptions thrown after will still result in changes
-	Handle_t hndl = handlesys->CreateHandle(g_MidHookRegistersType, (void *)regs, hook->Callback()->GetParentRuntime()->GetDefaultContext()->GetIdentity(), myself->GetIdentity(), NULL);
-	hook->Callback()->PushCell(hndl);
-	hook->Callback()->Execute(nullptr);
+	// The callback is free to delete its own hook, so don't touch it after Execute
+	hook->m_Hits++;
+
+	if (hook->m_Counter)
+		return;
+
+	// Span ends only ever stamp the time
+	if (hook->m_Span)
+	{
+		if (hook->m_SpanStop)
+			hook->m_Span->OnStop();
+		else
+			hook->m_Span->OnStart();
+		return;
+	}
+
+	// The callback only runs if every mode that's on passes through
+	bool skip = false;
+	if (hook->m_Sketch)
+	{
+		hook->m_Sketch->Add(hook->m_AggregateSource.Read(regs));
+		skip |= !hook->m_Passthrough;
+	}
+
+	if (hook->m_Stacks)
+	{
+		hook->m_Stacks->Add(regs->esp, regs->ebp);
+		skip |= !hook->m_StacksPassthrough;
+	}
+
+	if (hook->m_Trace.active)
+	{
+		hook->TraceHit(regs);
+		skip |= !hook->m_Trace.passthrough;
+	}
+
+	if (skip)
+		return;
+
+	cell_t oldval = 0;
+	cell_t newval = 0;
+	if (hook->m_Watch.active && !hook->Changed(regs, &oldval, &newval))
+		return;
+
+	if (hook->m_SampleRate > 1)
+	{
+		if (++hook->m_SampleSkip < hook->m_SampleRate)
+			return;
+		hook->m_SampleSkip = 0;
+	}
+
+	IPluginFunction *callback = hook->Callback();
+	cell_t data = hook->Data();
+	IdentityToken_t *identity = callback->GetParentRuntime()->GetDefaultContext()->GetIdentity();
+
+	// Named after the hook, since the tool would only see the callback's name
+	IProfilingTool *tool = ActiveProfilingTool();
+	if (tool)
+		tool->EnterScope("MidHooks", hook->ScopeName());
+
+	Handle_t hndl = handlesys->CreateHandle(g_MidHookRegistersType, (void *)regs, identity, myself->GetIdentity(), NULL);
+	callback->PushCell(hndl);
+	callback->PushCell(data);
+	callback->PushCell(oldval);
+	callback->PushCell(newval);
+	callback->Execute(nullptr);
 
 	// smutils->LogMessage(myself, "eax -> %p", regs->eax);
 	// smutils->LogMessage(myself, "ecx -> %p", regs->ecx);
@@ -195,6 +372,9 @@ volatile void MidHook::CallbackHandler(MidHook *hook, MidHookRegisters *regs)
 	// smutils->LogMessage(myself, "xmm7 -> %x %x %x %x", regs->xmm7[0], regs->xmm7[1], regs->xmm7[2], regs->xmm7[3]);
 	// smutils->LogMessage(myself, "esp -> %p", regs->esp);
 
-	HandleSecurity sec(hook->Callback()->GetParentRuntime()->GetDefaultContext()->GetIdentity(), myself->GetIdentity());
+	HandleSecurity sec(identity, myself->GetIdentity());
 	handlesys->FreeHandle(hndl, &sec);
+
+	if (tool)
+		tool->LeaveScope();
 }
\ No newline at end of file
@@ -1,6 +1,11 @@
 #pragma once
 
 #include "extension.h"
+#include "execmem.h"
+#include "sketch.h"
+#include "stacks.h"
+#include "stats.h"
+#include "budget.h"
 
 #ifdef PLATFORM_X64
 #error Good luck with that
@@ -57,6 +62,15 @@ enum DHookRegister
 	DHookRegister_ST0
 };
 
+// Also from dhooks
+enum CallingConvention
+{
+	CallConv_CDECL,
+	CallConv_THISCALL,
+	CallConv_STDCALL,
+	CallConv_FASTCALL
+};
+
 #if 0
 class MidJmp
 {
@@ -200,34 +214,191 @@ private:
 #endif
 
 struct MidHookRegisters;
+class HookSite;
+class HookSpan;
 
 class MidHook
 {
+	friend class HookRegistry;
+	friend class HookSite;
+
 public:
-	MidHook(void *, IPluginFunction *, bool);
+	MidHook(void *, IPluginFunction *, IPluginContext *, cell_t data);
 	~MidHook();
 
-	bool Enable();
+	// Returns false if already enabled
+	// Otherwise if this fails, error is filled
+	bool Enable(char *error, size_t maxlen);
 	bool Disable();
+	// The owner is unloading, so disable and forget about its callback
+	// A cloned handle can keep the hook around, but it can't be enabled again
+	void Release();
 
-	bool Enabled() { return m_Enabled; }
+	bool Enabled() { return m_Site != nullptr; }
 	IPluginFunction *Callback() { return m_Callback; }
+	// Takes effect from the next call, the running one (if any) keeps
+	// the callback it started with
+	// The callback has to be in the owner
+	void SetCallback(IPluginFunction *callback);
+	// nullptr once the plugin has unloaded
+	IPluginContext *Owner() { return m_Owner; }
+	const char *OwnerName();
+	// "plugin.smx:module!symbol+0xoffset", what profiling tools see the callback as
+	const char *ScopeName();
+	cell_t Data() { return m_Data; }
+	void SetData(cell_t data) { m_Data = data; }
 	void *Target() { return m_Target; }
-	void *ReturnAddress() { return Enabled() ? (void *)((unsigned char *)m_Target + m_ByteLen) : nullptr; }
+	void *ReturnAddress();
+	// Unique for the lifetime of the extension, for the console
+	int Id() { return m_Id; }
+	HookSite *Site() { return m_Site; }
+
+	// Only call back when reg (or [reg+offset] with deref) changes between hits
+	// The first hit just records the value
+	// Returns false if the register can't be watched that way
+	bool Watch(DHookRegister reg, bool deref, int offset, int numbertype);
+	void Unwatch() { m_Watch.active = false; }
+
+	// Count the values reg (or [reg+offset]) takes in a sketch
+	// Unless passthrough, the callback isn't called while aggregating
+	bool Aggregate(DHookRegister reg, bool deref, int offset, int numbertype, int capacity, bool exact, bool passthrough);
+	void StopAggregating();
+	ValueSketch *Sketch() { return m_Sketch; }
+
+	// Count the call stacks the hook is reached from, see StackTable
+	// Unless passthrough, the callback isn't called while collecting
+	void CollectStacks(int depth, int capacity, bool entry, bool passthrough);
+	void StopCollectingStacks();
+	StackTable *Stacks() { return m_Stacks; }
+
+	// Append the registers in regmask (bit n is MidHookReg n) and memlen bytes at
+	// [memreg+memoffs] to the trace file on every hit, see trace.h
+	// Unless passthrough, the callback isn't called while tracing
+	// Returns false if memreg can't be read from
+	bool Trace(uint32_t regmask, DHookRegister memreg, int memoffs, int memlen, bool passthrough);
+	void StopTracing() { m_Trace.active = false; }
+	bool Tracing() { return m_Trace.active; }
+
+	// Caps the cycles spent dispatching to this hook each period, see HookSite::Dispatch
+	// Going over cuts the callback to one hit in samplerate, or disables the hook if
+	// that was already done or action says to, then calls forward (the owner's
+	// MidHook_OnBudgetExceeded, if it has one) with handle
+	void SetBudget(uint64_t cycles, MidHookBudgetPeriod period, MidHookBudgetAction action, int samplerate, Handle_t handle, IPluginFunction *forward);
+	void ClearBudget() { m_Budget.cycles = 0; }
+	bool Budgeted() { return m_Budget.cycles != 0; }
+	// After every timed call, returns true if that put the hook over budget
+	bool ChargeBudget(uint64_t cycles);
+	// Demotes the hook and calls into the plugin, so only once the slot has
+	// been dispatched, see HookSite::Dispatch
+	void OverBudget();
+
+	// The callback only runs on one hit in rate, the modes still see every hit
+	void SetSampleRate(int rate)
+	{
+		m_SampleRate = rate;
+		m_SampleSkip = 0;
+	}
+	int SampleRate() { return m_SampleRate; }
+
+	// Only counts hits, which replaces the callback
+	// Alone at its address, it gets a bridge that does nothing else, see HookSite::EmitCounter
+	void SetCounter() { m_Counter = true; }
+	bool Counter() { return m_Counter; }
+
+	// Makes this one end of a span, which replaces the callback
+	void SetSpan(HookSpan *span, bool stop)
+	{
+		m_Span = span;
+		m_SpanStop = stop;
+	}
+	HookSpan *Span() { return m_Span; }
+	bool SpanStop() { return m_SpanStop; }
 
-	static void Cleanup();
-	static void Cleanup(IPluginContext *);
-	static void Cleanup(MidHook *);
+	// Times the callback has been reached, profiling or not
+	uint64_t Hits();
+	// Cycles spent dispatching to this hook, while profiling
+	// nullptr until the first timed call
+	LatencyHistogram *Latency() { return m_Latency; }
+	void RecordLatency(uint64_t cycles);
+	void ResetStats();
 
 private:
+	// A register or [reg+offset], read on every hit
+	struct ValueSource
+	{
+		DHookRegister reg;
+		bool deref;
+		int offset;
+		int numbertype;
+
+		bool Init(DHookRegister reg, bool deref, int offset, int numbertype);
+		cell_t Read(MidHookRegisters *regs);
+	};
+
+	int m_Id = {};
 	void *m_Target = {};
-	void *m_Trampoline = {};
-	void *m_Bridge = {};
-	int m_ByteLen = {};
 	IPluginFunction *m_Callback = {};
-	bool m_Enabled = {};
+	IPluginContext *m_Owner = {};
+	// Passed to the callback after the registers
+	cell_t m_Data = {};
+	struct
+	{
+		bool active;
+		bool primed;
+		ValueSource source;
+		cell_t last;
+	} m_Watch = {};
+	ValueSource m_AggregateSource = {};
+	ValueSketch *m_Sketch = {};
+	bool m_Passthrough = {};
+	StackTable *m_Stacks = {};
+	bool m_StacksPassthrough = {};
+	struct
+	{
+		bool active;
+		bool passthrough;
+		uint32_t regmask;
+		DHookRegister memreg;
+		int memoffs;
+		int memlen;
+	} m_Trace = {};
+	struct
+	{
+		uint64_t cycles;
+		uint64_t spent;
+		// The g_BudgetWindows count spent is for
+		uint32_t window;
+		MidHookBudgetPeriod period;
+		MidHookBudgetAction action;
+		int samplerate;
+		Handle_t handle;
+		IPluginFunction *forward;
+	} m_Budget = {};
+	int m_SampleRate = 1;
+	// Hits skipped since the callback last ran
+	int m_SampleSkip = {};
+	bool m_Counter = {};
+	HookSpan *m_Span = {};
+	bool m_SpanStop = {};
+	uint64_t m_Hits = {};
+	LatencyHistogram *m_Latency = {};
+	// Built on the first profiled call, see InternScopeName
+	const char *m_ScopeName = {};
+	// Where we're patched in, while enabled
+	// Shared with any other hooks in the same patch window
+	HookSite *m_Site = {};
+
+	// Owner's hooks, see HookRegistry
+	MidHook *m_PrevInPlugin = {};
+	MidHook *m_NextInPlugin = {};
+
+	// Reads the watched value, returns whether it differs from the last hit
+	bool Changed(MidHookRegisters *regs, cell_t *oldval, cell_t *newval);
+	void TraceHit(MidHookRegisters *regs);
 
 	static volatile void CallbackHandler(MidHook *, MidHookRegisters *);
+
+	static int s_NextId;
 };
 
 enum NumberType
@@ -237,6 +408,42 @@ enum NumberType
 	NumberType_Int32
 };
 
+// Indices into the GetAll/SetAll arrays, matches MidHookReg in midhook.inc
+// The GPRs and XMM words are each in struct order so they can be copied as a block
+enum MidHookReg
+{
+	MidHookReg_EAX,
+	MidHookReg_ECX,
+	MidHookReg_EDX,
+	MidHookReg_EBX,
+	MidHookReg_EBP,
+	MidHookReg_ESI,
+	MidHookReg_EDI,
+	MidHookReg_EFLAGS,
+	MidHookReg_ESP,
+
+	MidHookReg_GPRCount,
+
+	// 4 cells each
+	MidHookReg_XMM0 = MidHookReg_GPRCount,
+	MidHookReg_XMM7 = MidHookReg_XMM0 + 7 * 4,
+
+	MidHookReg_Count = MidHookReg_XMM7 + 4
+};
+
+// Indices into the array used by MidHook.GetLatency()
+enum MidHookLatency
+{
+	MidHookLatency_Calls,
+	MidHookLatency_P50,
+	MidHookLatency_P99,
+	MidHookLatency_Max,
+	MidHookLatency_TotalLow,
+	MidHookLatency_TotalHigh,
+
+	MidHookLatency_Count
+};
+
 struct MidHookRegisters
 {
 	MidHookRegisters() = delete;
@@ -244,6 +451,9 @@ struct MidHookRegisters
 	MidHookRegisters(MidHookRegisters &&) = delete;
 	~MidHookRegisters() = delete;
 
+	// The layout of this struct is whatever the bridge pushes, which is
+	// generated from RegisterFrame below
+	// Add new registers there too
 	using reg = uintptr_t;
 	reg eax;
 	reg ecx;
@@ -269,405 +479,685 @@ struct MidHookRegisters
 	// in the midhook trampoline
 	reg esp;
 
-	bool Get(DHookRegister reg, int numbertype, cell_t *result)
+	static constexpr int NUM_GPRS = 7;
+	static constexpr int NUM_XMMS = 8;
+
+	bool Get(DHookRegister reg, int numbertype, cell_t *result);
+	bool Set(DHookRegister reg, int numbertype, const cell_t val);
+	bool Load(DHookRegister reg, int offset, int numbertype, cell_t *result);
+	bool Store(DHookRegister reg, int offset, int numbertype, const cell_t val);
+	// Arguments of the function being entered, for hooks on its first instruction
+	// Returns false for an unknown calling convention
+	bool GetArgs(int callconv, cell_t *out, int count);
+	// count elements of numbertype's size at reg+offset, one per cell
+	bool LoadArray(DHookRegister reg, int offset, int numbertype, cell_t *out, int count);
+	bool StoreArray(DHookRegister reg, int offset, int numbertype, const cell_t *in, int count);
+	// reg+offset, for the natives that do their own copying
+	bool Address(DHookRegister reg, int offset, void **result);
+	// [[[reg+offsets[0]]+offsets[1]]+...], the last offset is where the value is
+	// With nullsafe, a null pointer along the way loads 0 and stores nothing
+	// *hit is whether the chain was walked to the end
+	bool LoadChain(DHookRegister reg, const cell_t *offsets, int count, int numbertype, bool nullsafe, cell_t *result);
+	bool StoreChain(DHookRegister reg, const cell_t *offsets, int count, int numbertype, bool nullsafe, const cell_t val, bool *hit);
+	bool GetXmmWord(DHookRegister reg, intptr_t **result);
+	// lane is 0 for the low 64 bits, 1 for the high
+	bool GetDouble(DHookRegister reg, int lane, double *result);
+	bool SetDouble(DHookRegister reg, int lane, double val);
+
+	// out must hold MidHookReg_GPRCount cells, or MidHookReg_Count with xmm
+	void GetAll(cell_t *out, bool xmm)
 	{
-		MidHookRegisters::reg val;
-		switch (reg)
-		{
-		case DHookRegister_Default:
-		case DHookRegister_ST0:
-			// Unsupported
-			return false;
-
-		// No numbertype action for 8bit regs
-		case DHookRegister_AL:
-			*result = eax & 0xff;
-			return true;
-		case DHookRegister_CL:
-			*result = ecx & 0xff;
-			return true;
-		case DHookRegister_DL:
-			*result = edx & 0xff;
-			return true;
-		case DHookRegister_BL:
-			*result = ebx & 0xff;
-			return true;
-		case DHookRegister_AH:
-			*result = (eax >> 8) & 0xff;
-			return true;
-		case DHookRegister_CH:
-			*result = (ecx >> 8) & 0xff;
-			return true;
-		case DHookRegister_DH:
-			*result = (edx >> 8) & 0xff;
-			return true;
-		case DHookRegister_BH:
-			*result = (ebx >> 8) & 0xff;
-			return true;
-
-		case DHookRegister_EAX:
-			val = eax;
-			break;
-		case DHookRegister_ECX:
-			val = ecx;
-			break;
-		case DHookRegister_EDX:
-			val = edx;
-			break;
-		case DHookRegister_EBX:
-			val = ebx;
-			break;
-		case DHookRegister_ESP:
-			val = esp;
-			break;
-		case DHookRegister_EBP:
-			val = ebp;
-			break;
-		case DHookRegister_ESI:
-			val = esi;
-			break;
-		case DHookRegister_EDI:
-			val = edi;
-			break;
+		memcpy(&out[MidHookReg_EAX], &eax, NUM_GPRS * sizeof(reg));
+		out[MidHookReg_EFLAGS] = eflags;
+		out[MidHookReg_ESP] = esp;
 
-		// For XMM registers, via Get(), just return the first 32 bits
-		// No numbertype needed
-		case DHookRegister_XMM0:
-			*result = *xmm0;
-			return true;
-		case DHookRegister_XMM1:
-			*result = *xmm1;
-			return true;
-		case DHookRegister_XMM2:
-			*result = *xmm2;
-			return true;
-		case DHookRegister_XMM3:
-			*result = *xmm3;
-			return true;
-		case DHookRegister_XMM4:
-			*result = *xmm4;
-			return true;
-		case DHookRegister_XMM5:
-			*result = *xmm5;
-			return true;
-		case DHookRegister_XMM6:
-			*result = *xmm6;
-			return true;
-		case DHookRegister_XMM7:
-			*result = *xmm7;
-			return true;
+		if (xmm)
+			memcpy(&out[MidHookReg_XMM0], xmm0, NUM_XMMS * sizeof(xmmword));
+	}
 
-		default:
-			return false;
+	// Bit n of dirty writes in[n] for the GPRs
+	// Bit MidHookReg_GPRCount + n writes the 4 cells of XMMn
+	void SetAll(const cell_t *in, int dirty, bool xmm)
+	{
+		reg *gprs = &eax;
+		for (int i = 0; i < NUM_GPRS; i++)
+		{
+			if (dirty & (1 << i))
+				gprs[i] = in[i];
 		}
+		if (dirty & (1 << MidHookReg_EFLAGS))
+			eflags = in[MidHookReg_EFLAGS];
+		if (dirty & (1 << MidHookReg_ESP))
+			esp = in[MidHookReg_ESP];
 
-		switch (numbertype)
+		if (!xmm)
+			return;
+
+		xmmword *xmms = &xmm0;
+		for (int i = 0; i < NUM_XMMS; i++)
 		{
-		case NumberType_Int8:
-			*(int8_t *)result = (int8_t)val;
-			break;
-		case NumberType_Int16:
-			*(int16_t *)result = (int16_t)val;
-			break;
-		default:
-			*result = val;
-			break;
+			if (dirty & (1 << (MidHookReg_GPRCount + i)))
+				memcpy(xmms[i], &in[MidHookReg_XMM0 + i * 4], sizeof(xmmword));
 		}
-
-		return true;
 	}
 
-	bool Set(DHookRegister reg, int numbertype, const cell_t val)
+private:
+	reg *Slot(int offset)
 	{
-		MidHookRegisters::reg *addr;
-		switch (reg)
-		{
-		case DHookRegister_Default:
-		case DHookRegister_ST0:
-			// Unsupported
-			return false;
+		return (reg *)((uint8_t *)this + offset);
+	}
 
-		// No numbertype action for 8bit regs
-		case DHookRegister_AL:
-			eax = (eax & 0xFFFFFF00) | val;
-			return true;
-		case DHookRegister_CL:
-			ecx = (ecx & 0xFFFFFF00) | val;
-			return true;
-		case DHookRegister_DL:
-			edx = (edx & 0xFFFFFF00) | val;
-			return true;
-		case DHookRegister_BL:
-			ebx = (ebx & 0xFFFFFF00) | val;
-			return true;
-		case DHookRegister_AH:
-			eax = (eax & 0xFFFF00FF) | ((ucell_t)val << 8);
-			return true;
-		case DHookRegister_CH:
-			ecx = (ecx & 0xFFFF00FF) | ((ucell_t)val << 8);
-			return true;
-		case DHookRegister_DH:
-			edx = (edx & 0xFFFF00FF) | ((ucell_t)val << 8);
-			return true;
-		case DHookRegister_BH:
-			ebx = (ebx & 0xFFFF00FF) | ((ucell_t)val << 8);
-			return true;
+	// Address of the last link of the chain, or nullptr if a null was hit with nullsafe
+	bool ResolveChain(DHookRegister reg, const cell_t *offsets, int count, bool nullsafe, uint8_t **result);
+};
 
-		case DHookRegister_EAX:
-			addr = &eax;
-			break;
-		case DHookRegister_ECX:
-			addr = &ecx;
-			break;
-		case DHookRegister_EDX:
-			addr = &edx;
-			break;
-		case DHookRegister_EBX:
-			addr = &ebx;
-			break;
-		case DHookRegister_ESP:
-			addr = &esp;
-			break;
-		case DHookRegister_EBP:
-			addr = &ebp;
-			break;
-		case DHookRegister_ESI:
-			addr = &esi;
-			break;
-		case DHookRegister_EDI:
-			addr = &edi;
-			break;
+enum RegisterClass : uint8_t
+{
+	RegisterClass_None,
+	RegisterClass_GPR8,
+	RegisterClass_GPR32,
+	RegisterClass_XMM,
+	RegisterClass_Flags
+};
 
-		// For XMM registers, via Set(), just set the first 32 bits
-		// No numbertype needed
-		case DHookRegister_XMM0:
-			*xmm0 = val;
-			return true;
-		case DHookRegister_XMM1:
-			*xmm1 = val;
-			return true;
-		case DHookRegister_XMM2:
-			*xmm2 = val;
-			return true;
-		case DHookRegister_XMM3:
-			*xmm3 = val;
-			return true;
-		case DHookRegister_XMM4:
-			*xmm4 = val;
-			return true;
-		case DHookRegister_XMM5:
-			*xmm5 = val;
-			return true;
-		case DHookRegister_XMM6:
-			*xmm6 = val;
-			return true;
-		case DHookRegister_XMM7:
-			*xmm7 = val;
-			return true;
+// Machine encoding of the registers, for the bridge
+enum RegisterCode : uint8_t
+{
+	RegisterCode_EAX,
+	RegisterCode_ECX,
+	RegisterCode_EDX,
+	RegisterCode_EBX,
+	RegisterCode_ESP,
+	RegisterCode_EBP,
+	RegisterCode_ESI,
+	RegisterCode_EDI
+};
 
-		default:
+struct RegisterDesc
+{
+	RegisterClass cls;
+	uint8_t code;
+	uint8_t offset;
+	// For AH and friends
+	uint8_t shift;
+};
+
+#define REGISTER_DESC(cls, code, member, shift) {RegisterClass_##cls, code, (uint8_t)offsetof(MidHookRegisters, member), shift}
+
+// MidHookRegisters in struct order
+// The bridge pushes this back to front and pops it front to back
+constexpr RegisterDesc RegisterFrame[] = {
+	REGISTER_DESC(GPR32, RegisterCode_EAX, eax, 0),
+	REGISTER_DESC(GPR32, RegisterCode_ECX, ecx, 0),
+	REGISTER_DESC(GPR32, RegisterCode_EDX, edx, 0),
+	REGISTER_DESC(GPR32, RegisterCode_EBX, ebx, 0),
+	REGISTER_DESC(GPR32, RegisterCode_EBP, ebp, 0),
+	REGISTER_DESC(GPR32, RegisterCode_ESI, esi, 0),
+	REGISTER_DESC(GPR32, RegisterCode_EDI, edi, 0),
+	REGISTER_DESC(XMM, 0, xmm0, 0),
+	REGISTER_DESC(XMM, 1, xmm1, 0),
+	REGISTER_DESC(XMM, 2, xmm2, 0),
+	REGISTER_DESC(XMM, 3, xmm3, 0),
+	REGISTER_DESC(XMM, 4, xmm4, 0),
+	REGISTER_DESC(XMM, 5, xmm5, 0),
+	REGISTER_DESC(XMM, 6, xmm6, 0),
+	REGISTER_DESC(XMM, 7, xmm7, 0),
+	REGISTER_DESC(Flags, 0, eflags, 0),
+	REGISTER_DESC(GPR32, RegisterCode_ESP, esp, 0),
+};
+
+// Indexed by DHookRegister
+constexpr RegisterDesc RegisterTable[] = {
+	// DHookRegister_Default
+	{},
+
+	REGISTER_DESC(GPR8, RegisterCode_EAX, eax, 0),
+	REGISTER_DESC(GPR8, RegisterCode_ECX, ecx, 0),
+	REGISTER_DESC(GPR8, RegisterCode_EDX, edx, 0),
+	REGISTER_DESC(GPR8, RegisterCode_EBX, ebx, 0),
+	REGISTER_DESC(GPR8, RegisterCode_EAX, eax, 8),
+	REGISTER_DESC(GPR8, RegisterCode_ECX, ecx, 8),
+	REGISTER_DESC(GPR8, RegisterCode_EDX, edx, 8),
+	REGISTER_DESC(GPR8, RegisterCode_EBX, ebx, 8),
+
+	REGISTER_DESC(GPR32, RegisterCode_EAX, eax, 0),
+	REGISTER_DESC(GPR32, RegisterCode_ECX, ecx, 0),
+	REGISTER_DESC(GPR32, RegisterCode_EDX, edx, 0),
+	REGISTER_DESC(GPR32, RegisterCode_EBX, ebx, 0),
+	REGISTER_DESC(GPR32, RegisterCode_ESP, esp, 0),
+	REGISTER_DESC(GPR32, RegisterCode_EBP, ebp, 0),
+	REGISTER_DESC(GPR32, RegisterCode_ESI, esi, 0),
+	REGISTER_DESC(GPR32, RegisterCode_EDI, edi, 0),
+
+	REGISTER_DESC(XMM, 0, xmm0, 0),
+	REGISTER_DESC(XMM, 1, xmm1, 0),
+	REGISTER_DESC(XMM, 2, xmm2, 0),
+	REGISTER_DESC(XMM, 3, xmm3, 0),
+	REGISTER_DESC(XMM, 4, xmm4, 0),
+	REGISTER_DESC(XMM, 5, xmm5, 0),
+	REGISTER_DESC(XMM, 6, xmm6, 0),
+	REGISTER_DESC(XMM, 7, xmm7, 0),
+
+	// DHookRegister_ST0, unsupported
+	{},
+};
+
+#undef REGISTER_DESC
+
+constexpr size_t RegisterSize(RegisterClass cls)
+{
+	return cls == RegisterClass_XMM ? sizeof(MidHookRegisters::xmmword) : sizeof(MidHookRegisters::reg);
+}
+
+// The frame has to tile the struct exactly, or the bridge and
+// MidHookRegisters disagree about where things are
+constexpr bool RegisterFrameMatchesStruct()
+{
+	size_t offset = 0;
+	for (const RegisterDesc &desc : RegisterFrame)
+	{
+		if (desc.offset != offset)
 			return false;
-		}
+		offset += RegisterSize(desc.cls);
+	}
+	return offset == sizeof(MidHookRegisters);
+}
 
-		switch (numbertype)
-		{
-		case NumberType_Int8:
-			*(int8_t *)addr = (int8_t)val;
-			break;
-		case NumberType_Int16:
-			*(int16_t *)addr = (int16_t)val;
-			break;
-		default:
-			*addr = val;
-			break;
-		}
+static_assert(RegisterFrameMatchesStruct(), "RegisterFrame does not match MidHookRegisters");
+static_assert(sizeof(RegisterTable) / sizeof(RegisterTable[0]) == DHookRegister_ST0 + 1, "RegisterTable does not match DHookRegister");
+static_assert(RegisterFrame[sizeof(RegisterFrame) / sizeof(RegisterFrame[0]) - 1].code == RegisterCode_ESP, "esp must be last in RegisterFrame");
 
-		return true;
+inline const RegisterDesc *LookupRegister(DHookRegister reg, int classes)
+{
+	if ((unsigned)reg >= sizeof(RegisterTable) / sizeof(RegisterTable[0]))
+		return nullptr;
+
+	const RegisterDesc *desc = &RegisterTable[reg];
+	return (classes & (1 << desc->cls)) ? desc : nullptr;
+}
+
+// Partial-width reads and writes only touch the low bytes
+inline void ReadNumber(const void *src, int numbertype, cell_t *result)
+{
+	switch (numbertype)
+	{
+	case NumberType_Int8:
+		*(int8_t *)result = *(const int8_t *)src;
+		break;
+	case NumberType_Int16:
+		*(int16_t *)result = *(const int16_t *)src;
+		break;
+	default:
+		*result = *(const cell_t *)src;
+		break;
 	}
+}
 
-	bool Load(DHookRegister reg, int offset, int numbertype, cell_t *result)
+inline void WriteNumber(void *dest, int numbertype, cell_t val)
+{
+	switch (numbertype)
 	{
-		cell_t val;
-		switch (reg)
-		{
-		case DHookRegister_EAX:
-			val = *(intptr_t *)(eax + offset);
-			break;
-		case DHookRegister_ECX:
-			val = *(intptr_t *)(ecx + offset);
-			break;
-		case DHookRegister_EDX:
-			val = *(intptr_t *)(edx + offset);
-			break;
-		case DHookRegister_EBX:
-			val = *(intptr_t *)(ebx + offset);
-			break;
-		case DHookRegister_ESP:
-			val = *(intptr_t *)(esp + offset);
-			break;
-		case DHookRegister_EBP:
-			val = *(intptr_t *)(ebp + offset);
-			break;
-		case DHookRegister_ESI:
-			val = *(intptr_t *)(esi + offset);
-			break;
-		case DHookRegister_EDI:
-			val = *(intptr_t *)(edi + offset);
-			break;
+	case NumberType_Int8:
+		*(int8_t *)dest = (int8_t)val;
+		break;
+	case NumberType_Int16:
+		*(int16_t *)dest = (int16_t)val;
+		break;
+	default:
+		*(cell_t *)dest = val;
+		break;
+	}
+}
 
-		// XMM and 8bit regs die here
-		// TODO; Maybe allow XMM words and clamp to 0-3?
-		default:
-			return false;
-		}
+inline bool MidHookRegisters::Get(DHookRegister reg, int numbertype, cell_t *result)
+{
+	const RegisterDesc *desc = LookupRegister(reg, (1 << RegisterClass_GPR8) | (1 << RegisterClass_GPR32) | (1 << RegisterClass_XMM));
+	if (!desc)
+		return false;
 
-		switch (numbertype)
-		{
-		case NumberType_Int8:
-			*(int8_t *)result = (int8_t)val;
-			break;
-		case NumberType_Int16:
-			*(int16_t *)result = (int16_t)val;
-			break;
-		default:
-			*result = val;
-			break;
-		}
+	MidHookRegisters::reg *slot = Slot(desc->offset);
+	switch (desc->cls)
+	{
+	// No numbertype action for 8bit regs
+	case RegisterClass_GPR8:
+		*result = (*slot >> desc->shift) & 0xff;
+		break;
+	// For XMM registers, via Get(), just return the first 32 bits
+	// No numbertype needed
+	case RegisterClass_XMM:
+		*result = *slot;
+		break;
+	default:
+		ReadNumber(slot, numbertype, result);
+		break;
+	}
+	return true;
+}
 
-		return true;
+inline bool MidHookRegisters::Set(DHookRegister reg, int numbertype, const cell_t val)
+{
+	const RegisterDesc *desc = LookupRegister(reg, (1 << RegisterClass_GPR8) | (1 << RegisterClass_GPR32) | (1 << RegisterClass_XMM));
+	if (!desc)
+		return false;
+
+	MidHookRegisters::reg *slot = Slot(desc->offset);
+	switch (desc->cls)
+	{
+	case RegisterClass_GPR8:
+		*slot = (*slot & ~(0xffu << desc->shift)) | (((ucell_t)val & 0xff) << desc->shift);
+		break;
+	// For XMM registers, via Set(), just set the first 32 bits
+	case RegisterClass_XMM:
+		*slot = val;
+		break;
+	default:
+		WriteNumber(slot, numbertype, val);
+		break;
 	}
+	return true;
+}
 
-	bool Store(DHookRegister reg, int numbertype, int offset, const cell_t val)
+// XMM and 8bit regs die here
+// TODO; Maybe allow XMM words and clamp to 0-3?
+inline bool MidHookRegisters::Load(DHookRegister reg, int offset, int numbertype, cell_t *result)
+{
+	const RegisterDesc *desc = LookupRegister(reg, 1 << RegisterClass_GPR32);
+	if (!desc)
+		return false;
+
+	ReadNumber((void *)(*Slot(desc->offset) + offset), numbertype, result);
+	return true;
+}
+
+inline bool MidHookRegisters::Store(DHookRegister reg, int offset, int numbertype, const cell_t val)
+{
+	const RegisterDesc *desc = LookupRegister(reg, 1 << RegisterClass_GPR32);
+	if (!desc)
+		return false;
+
+	WriteNumber((void *)(*Slot(desc->offset) + offset), numbertype, val);
+	return true;
+}
+
+inline bool MidHookRegisters::GetArgs(int callconv, cell_t *out, int count)
+{
+	// Leading arguments passed in registers
+	const reg *regargs[2] = {};
+	int numregargs;
+	switch (callconv)
 	{
-		intptr_t *result;
-		switch (reg)
-		{
-		case DHookRegister_EAX:
-			result = (intptr_t *)(eax + offset);
-			break;
-		case DHookRegister_ECX:
-			result = (intptr_t *)(ecx + offset);
-			break;
-		case DHookRegister_EDX:
-			result = (intptr_t *)(edx + offset);
-			break;
-		case DHookRegister_EBX:
-			result = (intptr_t *)(ebx + offset);
-			break;
-		case DHookRegister_ESP:
-			result = (intptr_t *)(esp + offset);
-			break;
-		case DHookRegister_EBP:
-			result = (intptr_t *)(ebp + offset);
-			break;
-		case DHookRegister_ESI:
-			result = (intptr_t *)(esi + offset);
-			break;
-		case DHookRegister_EDI:
-			result = (intptr_t *)(edi + offset);
-			break;
+	case CallConv_CDECL:
+	case CallConv_STDCALL:
+		numregargs = 0;
+		break;
+	case CallConv_THISCALL:
+#if defined _LINUX
+		// GCC passes this on the stack like any other argument
+		numregargs = 0;
+#else
+		regargs[0] = &ecx;
+		numregargs = 1;
+#endif
+		break;
+	case CallConv_FASTCALL:
+		regargs[0] = &ecx;
+		regargs[1] = &edx;
+		numregargs = 2;
+		break;
+	default:
+		return false;
+	}
 
-		// XMM and 8bit regs die here
-		// TODO; Maybe allow XMM words and clamp to 0-3?
-		default:
-			return false;
-		}
+	// The rest are above the return address
+	const cell_t *stack = (const cell_t *)(esp + sizeof(void *));
+	for (int i = 0; i < count; i++)
+		out[i] = i < numregargs ? *regargs[i] : stack[i - numregargs];
+	return true;
+}
 
-		switch (numbertype)
-		{
-		case NumberType_Int8:
-			*(int8_t *)result = (int8_t)val;
-			break;
-		case NumberType_Int16:
-			*(int16_t *)result = (int16_t)val;
-			break;
-		default:
-			*result = val;
-			break;
-		}
+inline bool MidHookRegisters::Address(DHookRegister reg, int offset, void **result)
+{
+	const RegisterDesc *desc = LookupRegister(reg, 1 << RegisterClass_GPR32);
+	if (!desc)
+		return false;
 
-		return true;
+	*result = (void *)(*Slot(desc->offset) + offset);
+	return true;
+}
+
+inline bool MidHookRegisters::LoadArray(DHookRegister reg, int offset, int numbertype, cell_t *out, int count)
+{
+	void *src;
+	if (!Address(reg, offset, &src))
+		return false;
+
+	switch (numbertype)
+	{
+	case NumberType_Int8:
+		for (int i = 0; i < count; i++)
+			out[i] = ((uint8_t *)src)[i];
+		break;
+	case NumberType_Int16:
+		for (int i = 0; i < count; i++)
+			out[i] = ((uint16_t *)src)[i];
+		break;
+	default:
+		memcpy(out, src, count * sizeof(cell_t));
+		break;
 	}
+	return true;
+}
 
-	bool GetXmmWord(DHookRegister reg, intptr_t **result)
+inline bool MidHookRegisters::StoreArray(DHookRegister reg, int offset, int numbertype, const cell_t *in, int count)
+{
+	void *dest;
+	if (!Address(reg, offset, &dest))
+		return false;
+
+	switch (numbertype)
 	{
-		switch (reg)
-		{
-		case DHookRegister_XMM0:
-			*result = (intptr_t *)xmm0;
-			break;
-		case DHookRegister_XMM1:
-			*result = (intptr_t *)xmm1;
-			break;
-		case DHookRegister_XMM2:
-			*result = (intptr_t *)xmm2;
-			break;
-		case DHookRegister_XMM3:
-			*result = (intptr_t *)xmm3;
-			break;
-		case DHookRegister_XMM4:
-			*result = (intptr_t *)xmm4;
-			break;
-		case DHookRegister_XMM5:
-			*result = (intptr_t *)xmm5;
-			break;
-		case DHookRegister_XMM6:
-			*result = (intptr_t *)xmm6;
-			break;
-		case DHookRegister_XMM7:
-			*result = (intptr_t *)xmm7;
-			break;
-		default:
-			return false;
-		}
+	case NumberType_Int8:
+		for (int i = 0; i < count; i++)
+			((uint8_t *)dest)[i] = (uint8_t)in[i];
+		break;
+	case NumberType_Int16:
+		for (int i = 0; i < count; i++)
+			((uint16_t *)dest)[i] = (uint16_t)in[i];
+		break;
+	default:
+		memcpy(dest, in, count * sizeof(cell_t));
+		break;
+	}
+	return true;
+}
 
-		return true;
+inline bool MidHookRegisters::ResolveChain(DHookRegister reg, const cell_t *offsets, int count, bool nullsafe, uint8_t **result)
+{
+	const RegisterDesc *desc = LookupRegister(reg, 1 << RegisterClass_GPR32);
+	if (!desc)
+		return false;
+
+	uint8_t *addr = (uint8_t *)*Slot(desc->offset);
+	for (int i = 0; i < count - 1; i++)
+	{
+		if (nullsafe && !addr)
+			break;
+		addr = *(uint8_t **)(addr + offsets[i]);
 	}
-};
+
+	*result = (nullsafe && !addr) ? nullptr : addr + offsets[count - 1];
+	return true;
+}
+
+inline bool MidHookRegisters::LoadChain(DHookRegister reg, const cell_t *offsets, int count, int numbertype, bool nullsafe, cell_t *result)
+{
+	uint8_t *addr;
+	if (!ResolveChain(reg, offsets, count, nullsafe, &addr))
+		return false;
+
+	*result = 0;
+	if (addr)
+		ReadNumber(addr, numbertype, result);
+	return true;
+}
+
+inline bool MidHookRegisters::StoreChain(DHookRegister reg, const cell_t *offsets, int count, int numbertype, bool nullsafe, const cell_t val, bool *hit)
+{
+	uint8_t *addr;
+	if (!ResolveChain(reg, offsets, count, nullsafe, &addr))
+		return false;
+
+	*hit = addr != nullptr;
+	if (addr)
+		WriteNumber(addr, numbertype, val);
+	return true;
+}
+
+inline bool MidHookRegisters::GetXmmWord(DHookRegister reg, intptr_t **result)
+{
+	const RegisterDesc *desc = LookupRegister(reg, 1 << RegisterClass_XMM);
+	if (!desc)
+		return false;
+
+	*result = (intptr_t *)Slot(desc->offset);
+	return true;
+}
+
+inline bool MidHookRegisters::GetDouble(DHookRegister reg, int lane, double *result)
+{
+	const RegisterDesc *desc = LookupRegister(reg, 1 << RegisterClass_XMM);
+	if (!desc)
+		return false;
+
+	memcpy(result, (uint8_t *)Slot(desc->offset) + lane * sizeof(double), sizeof(double));
+	return true;
+}
+
+inline bool MidHookRegisters::SetDouble(DHookRegister reg, int lane, double val)
+{
+	const RegisterDesc *desc = LookupRegister(reg, 1 << RegisterClass_XMM);
+	if (!desc)
+		return false;
+
+	memcpy((uint8_t *)Slot(desc->offset) + lane * sizeof(double), &val, sizeof(double));
+	return true;
+}
 
 class MAssembler : public sp::Assembler
 {
 public:
 	// ._.
-	void movups_esp_xmm(const sp::FloatRegister reg)
+	void movups_esp_xmm(int code)
 	{
 		writebyte(0x0f);
 		writebyte(0x11);
-		writebyte(0x04 + reg.code * 0x8);
+		writebyte(0x04 + code * 0x8);
 		writebyte(0x24);
 	}
 
 	// sub esp, 10h
 	// movups [esp], xmm*
-	void pushmm(const sp::FloatRegister reg)
+	void pushmm(int code)
 	{
 		subl(sp::esp, sizeof(MidHookRegisters::xmmword));
-		movups_esp_xmm(reg);
+		movups_esp_xmm(code);
 	}
 
 	// .____.
-	void movups_xmm_esp(const sp::FloatRegister reg)
+	void movups_xmm_esp(int code)
 	{
 		writebyte(0x0f);
 		writebyte(0x10);
-		writebyte(0x04 + reg.code * 0x8);
+		writebyte(0x04 + code * 0x8);
 		writebyte(0x24);
 	}
 
 	// movups xmm*, [esp]
 	// add esp, 10h
-	void popmm(const sp::FloatRegister reg)
+	void popmm(int code)
 	{
-		movups_xmm_esp(reg);
+		movups_xmm_esp(code);
 		addl(sp::esp, sizeof(MidHookRegisters::xmmword));
 	}
 
+	// push r32
+	void pushreg(int code)
+	{
+		writebyte(0x50 + code);
+	}
+
+	// pop r32
+	void popreg(int code)
+	{
+		writebyte(0x58 + code);
+	}
+
+	// Push a RegisterFrame entry
+	void pushframe(const RegisterDesc &desc)
+	{
+		switch (desc.cls)
+		{
+		case RegisterClass_XMM:
+			pushmm(desc.code);
+			break;
+		case RegisterClass_Flags:
+			pushfd();
+			break;
+		default:
+			pushreg(desc.code);
+			break;
+		}
+	}
+
+	void popframe(const RegisterDesc &desc)
+	{
+		switch (desc.cls)
+		{
+		case RegisterClass_XMM:
+			popmm(desc.code);
+			break;
+		case RegisterClass_Flags:
+			popfd();
+			break;
+		default:
+			popreg(desc.code);
+			break;
+		}
+	}
+
 	void writebyte(uint8_t b)
 	{
 		ensureSpace();
 		writeByte(b);
 	}
 
+	void writeint32(int32_t i)
+	{
+		for (size_t n = 0; n < sizeof(i); n++)
+			writebyte((uint8_t)(i >> (n * 8)));
+	}
+
+	// call rel32
+	// Unlike call(ExternalAddress), the displacement is computed in emit()
+	// against the executable address rather than the one written to
+	void callrel(void *target)
+	{
+		writebyte(0xe8);
+		reloc(target);
+	}
+
+	// jmp rel32
+	void jmprel(void *target)
+	{
+		writebyte(0xe9);
+		reloc(target);
+	}
+
+	void emit(const CodeBlock &block)
+	{
+		memcpy(block.write, buffer(), length());
+		for (const auto &r : m_Relocs)
+		{
+			intptr_t next = (intptr_t)block.exec + r.first + sizeof(int32_t);
+			*(int32_t *)((uint8_t *)block.write + r.first) = (int32_t)((intptr_t)r.second - next);
+		}
+	}
+
+	// add dword [counter], 1
+	// adc dword [counter + 4], 0
+	// Clobbers the flags
+	void incmem64(uint64_t *counter)
+	{
+		writebyte(0x83);
+		writebyte(0x05);
+		writeint32((int32_t)(intptr_t)counter);
+		writebyte(0x01);
+
+		writebyte(0x83);
+		writebyte(0x15);
+		writeint32((int32_t)((intptr_t)counter + 4));
+		writebyte(0x00);
+	}
+
+	// op r32, [addr] or op [addr], r32, depending on the opcode
+	void memop(uint8_t opcode, int code, const void *addr)
+	{
+		writebyte(opcode);
+		writebyte(0x05 + code * 0x8);
+		writeint32((int32_t)(intptr_t)addr);
+	}
+
+	// mov dword [addr], imm32
+	void movmem32(const void *addr, int32_t imm)
+	{
+		writebyte(0xc7);
+		writebyte(0x05);
+		writeint32((int32_t)(intptr_t)addr);
+		writeint32(imm);
+	}
+
+	// cmp dword [addr], imm32
+	void cmpmem32(const void *addr, int32_t imm)
+	{
+		writebyte(0x81);
+		writebyte(0x3d);
+		writeint32((int32_t)(intptr_t)addr);
+		writeint32(imm);
+	}
+
+	// Clobbers eax and edx
+	void rdtsc()
+	{
+		writebyte(0x0f);
+		writebyte(0x31);
+	}
+
+	// mov eax, <this thread's TEB or TCB>
+	// Matches HookSpan::ThreadSelf
+	void movthreadself()
+	{
+#if defined _MSC_VER
+		// mov eax, fs:[18h]
+		writebyte(0x64);
+		writebyte(0xa1);
+		writeint32(0x18);
+#else
+		// mov eax, gs:[0]
+		writebyte(0x65);
+		writebyte(0xa1);
+		writeint32(0);
+#endif
+	}
+
+	// j* rel8 forward, returns where to bindrel8 it from
+	uint32_t jrel8(uint8_t opcode)
+	{
+		writebyte(opcode);
+		writebyte(0);
+		return (uint32_t)length();
+	}
+
+	// Point a jrel8 at what comes next
+	void bindrel8(uint32_t from)
+	{
+		buffer()[from - 1] = (uint8_t)(length() - from);
+	}
+
+	// j* rel32 forward, opcode being the one after 0fh
+	uint32_t jrel32(uint8_t opcode)
+	{
+		writebyte(0x0f);
+		writebyte(opcode);
+		writeint32(0);
+		return (uint32_t)length();
+	}
+
+	void bindrel32(uint32_t from)
+	{
+		int32_t rel = (int32_t)(length() - from);
+		memcpy(buffer() + from - sizeof(rel), &rel, sizeof(rel));
+	}
+
 	void pushfd()
 	{
 		writebyte(0x9c);
@@ -677,6 +1167,14 @@ public:
 	{
 		writebyte(0x9d);
 	}
-};
 
-extern std::vector<MidHook *> g_Hooks;
\ No newline at end of file
+private:
+	void reloc(void *target)
+	{
+		m_Relocs.emplace_back(length(), target);
+		writeint32(0);
+	}
+
+	// Offset of the rel32 -> target
+	std::vector<std::pair<uint32_t, void *>> m_Relocs;
+};
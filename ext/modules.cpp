@@ -0,0 +1,102 @@
+#include "modules.h"
+
+#if defined _LINUX
+#include <cxxabi.h>
+#include <dlfcn.h>
+#include <stdlib.h>
+#else
+#include <windows.h>
+#endif
+
+#include <string>
+#include <unordered_map>
+
+static std::unordered_map<uintptr_t, std::string> s_Symbols;
+
+void FormatAddress(const void *addr, char *buffer, size_t maxlen)
+{
+	const char *path = nullptr;
+	const void *base = nullptr;
+
+#if defined _LINUX
+	Dl_info info;
+	if (dladdr(addr, &info) && info.dli_fname)
+	{
+		path = info.dli_fname;
+		base = info.dli_fbase;
+	}
+#else
+	HMODULE module;
+	char filename[MAX_PATH];
+	if (GetModuleHandleExA(GET_MODULE_HANDLE_EX_FLAG_FROM_ADDRESS | GET_MODULE_HANDLE_EX_FLAG_UNCHANGED_REFCOUNT, (LPCSTR)addr, &module)
+		&& GetModuleFileNameA(module, filename, sizeof(filename)))
+	{
+		path = filename;
+		base = (const void *)module;
+	}
+#endif
+
+	if (!path)
+	{
+		snprintf(buffer, maxlen, "%p", addr);
+		return;
+	}
+
+	const char *name = path;
+	for (const char *c = path; *c; c++)
+	{
+		if (*c == '/' || *c == '\\')
+			name = c + 1;
+	}
+
+	snprintf(buffer, maxlen, "%s+0x%x", name, (unsigned)((uintptr_t)addr - (uintptr_t)base));
+}
+
+void FormatSymbol(const void *addr, char *buffer, size_t maxlen)
+{
+	auto cached = s_Symbols.find((uintptr_t)addr);
+	if (cached != s_Symbols.end())
+	{
+		snprintf(buffer, maxlen, "%s", cached->second.c_str());
+		return;
+	}
+
+	char location[512];
+	FormatAddress(addr, location, sizeof(location));
+
+#if defined _LINUX
+	Dl_info info;
+	if (dladdr(addr, &info) && info.dli_sname && info.dli_saddr)
+	{
+		int status;
+		char *demangled = abi::__cxa_demangle(info.dli_sname, nullptr, nullptr, &status);
+
+		// module+0xoffset -> module!symbol+0xoffset
+		char *plus = strrchr(location, '+');
+		if (plus)
+			*plus = '\0';
+
+		char symbol[1024];
+		snprintf(symbol, sizeof(symbol), "%s!%s+0x%x", location, demangled ? demangled : info.dli_sname,
+			(unsigned)((uintptr_t)addr - (uintptr_t)info.dli_saddr));
+		free(demangled);
+
+		s_Symbols[(uintptr_t)addr] = symbol;
+		snprintf(buffer, maxlen, "%s", symbol);
+		return;
+	}
+#endif
+
+	s_Symbols[(uintptr_t)addr] = location;
+	snprintf(buffer, maxlen, "%s", location);
+}
+
+const void *SymbolStart(const void *addr)
+{
+#if defined _LINUX
+	Dl_info info;
+	if (dladdr(addr, &info) && info.dli_sname)
+		return info.dli_saddr;
+#endif
+	return nullptr;
+}
@@ -0,0 +1,16 @@
+#pragma once
+
+#include "extension.h"
+
+// "module+0xoffset" for an address inside a loaded module, so it can be
+// matched up with a disassembler, otherwise just the address
+void FormatAddress(const void *addr, char *buffer, size_t maxlen);
+
+// "module!symbol+0xoffset" when the module exports a symbol covering addr,
+// otherwise the same as FormatAddress
+// Cached, since stack dumps resolve the same return addresses over and over
+void FormatSymbol(const void *addr, char *buffer, size_t maxlen);
+
+// Start of the exported symbol covering addr, or nullptr if there's none
+// Always nullptr on Windows, where only debug info would say
+const void *SymbolStart(const void *addr);
@@ -1,13 +1,18 @@
 #include "extension.h"
 #include "midhook.h"
+#include "registry.h"
+#include "trace.h"
+#include "span.h"
+#include "coverage.h"
 
 static cell_t Native_MidHook(IPluginContext *pContext, const cell_t *params)
 {
 	void *target = (void *)params[1];
 	IPluginFunction *callback = pContext->GetFunctionById(params[2]);
 	bool enable = (bool)params[3];
+	cell_t data = params[0] >= 4 ? params[4] : 0;
 
-	MidHook *hook = new MidHook(target, callback, enable);
+	MidHook *hook = new MidHook(target, callback, pContext, data);
 	Handle_t hndl = handlesys->CreateHandle(g_MidHookType, (void *)hook, pContext->GetIdentity(), myself->GetIdentity(), NULL);
 
 	if (!hndl)
@@ -16,7 +21,15 @@ static cell_t Native_MidHook(IPluginContext *pContext, const cell_t *params)
 		return pContext->ThrowNativeError("Failed to create MidHook handle");
 	}
 
-	g_Hooks.push_back(hook);
+	g_Registry.Add(hook);
+
+	char error[256];
+	if (enable && !hook->Enable(error, sizeof(error)))
+	{
+		HandleSecurity sec(pContext->GetIdentity(), myself->GetIdentity());
+		handlesys->FreeHandle(hndl, &sec);
+		return pContext->ThrowNativeError("%s", error);
+	}
 
 	return hndl;
 }
@@ -27,72 +40,1030 @@ static cell_t Native_MidHook_Enable(IPluginContext *pContext, const cell_t *para
 
 	MidHook *hook;
 	HandleSecurity sec(pContext->GetIdentity(), myself->GetIdentity());
-	HandleError err = handlesys->ReadHandle(hndl, g_MidHookType, &sec, (void **)&hook);
+	HandleError err = handlesys->ReadHandle(hndl, g_MidHookType, &sec, (void **)&hook);
+	if (err != HandleError_None)
+	{
+		return pContext->ThrowNativeError("Invalid Handle %x (error %d)", hndl, err);
+	}
+
+	if (hook->Enabled())
+		return false;
+
+	char error[256];
+	if (!hook->Enable(error, sizeof(error)))
+	{
+		return pContext->ThrowNativeError("%s", error);
+	}
+	return true;
+}
+
+static cell_t Native_MidHook_Disable(IPluginContext *pContext, const cell_t *params)
+{
+	Handle_t hndl = (Handle_t)params[1];
+	MidHook *hook;
+	HandleSecurity sec(pContext->GetIdentity(), myself->GetIdentity());
+	HandleError err = handlesys->ReadHandle(hndl, g_MidHookType, &sec, (void **)&hook);
+	if (err != HandleError_None)
+	{
+		return pContext->ThrowNativeError("Invalid Handle %x (error %d)", hndl, err);
+	}
+
+	return (cell_t)hook->Disable();
+}
+
+static cell_t Native_MidHook_Enabled_Get(IPluginContext *pContext, const cell_t *params)
+{
+	Handle_t hndl = (Handle_t)params[1];
+	MidHook *hook;
+	HandleSecurity sec(pContext->GetIdentity(), myself->GetIdentity());
+	HandleError err = handlesys->ReadHandle(hndl, g_MidHookType, &sec, (void **)&hook);
+	if (err != HandleError_None)
+	{
+		return pContext->ThrowNativeError("Invalid Handle %x (error %d)", hndl, err);
+	}
+
+	return (cell_t)hook->Enabled();
+}
+
+static cell_t Native_MidHook_TargetAddress_Get(IPluginContext *pContext, const cell_t *params)
+{
+	Handle_t hndl = (Handle_t)params[1];
+	MidHook *hook;
+	HandleSecurity sec(pContext->GetIdentity(), myself->GetIdentity());
+	HandleError err = handlesys->ReadHandle(hndl, g_MidHookType, &sec, (void **)&hook);
+	if (err != HandleError_None)
+	{
+		return pContext->ThrowNativeError("Invalid Handle %x (error %d)", hndl, err);
+	}
+
+	return (cell_t)hook->Target();
+}
+
+static cell_t Native_MidHook_ReturnAddress_Get(IPluginContext *pContext, const cell_t *params)
+{
+	Handle_t hndl = (Handle_t)params[1];
+	MidHook *hook;
+	HandleSecurity sec(pContext->GetIdentity(), myself->GetIdentity());
+	HandleError err = handlesys->ReadHandle(hndl, g_MidHookType, &sec, (void **)&hook);
+	if (err != HandleError_None)
+	{
+		return pContext->ThrowNativeError("Invalid Handle %x (error %d)", hndl, err);
+	}
+
+	return (cell_t)hook->ReturnAddress();
+}
+
+static cell_t Native_MidHook_SetCallback(IPluginContext *pContext, const cell_t *params)
+{
+	Handle_t hndl = (Handle_t)params[1];
+	MidHook *hook;
+	HandleSecurity sec(pContext->GetIdentity(), myself->GetIdentity());
+	HandleError err = handlesys->ReadHandle(hndl, g_MidHookType, &sec, (void **)&hook);
+	if (err != HandleError_None)
+	{
+		return pContext->ThrowNativeError("Invalid Handle %x (error %d)", hndl, err);
+	}
+
+	// The hook goes down with its plugin, so its callback has to be in there too
+	if (pContext != hook->Owner())
+	{
+		return pContext->ThrowNativeError("Only the plugin that created a MidHook can set its callback");
+	}
+
+	IPluginFunction *callback = pContext->GetFunctionById(params[2]);
+	if (!callback)
+	{
+		return pContext->ThrowNativeError("Invalid function id (%X)", params[2]);
+	}
+
+	hook->SetCallback(callback);
+	return 0;
+}
+
+static cell_t Native_MidHook_Watch(IPluginContext *pContext, const cell_t *params)
+{
+	Handle_t hndl = (Handle_t)params[1];
+	MidHook *hook;
+	HandleSecurity sec(pContext->GetIdentity(), myself->GetIdentity());
+	HandleError err = handlesys->ReadHandle(hndl, g_MidHookType, &sec, (void **)&hook);
+	if (err != HandleError_None)
+	{
+		return pContext->ThrowNativeError("Invalid Handle %x (error %d)", hndl, err);
+	}
+
+	DHookRegister reg = (DHookRegister)params[2];
+	bool deref = (bool)params[3];
+	int offset = (int)params[4];
+	int numbertype = (int)params[5];
+
+	if (!hook->Watch(reg, deref, offset, numbertype))
+	{
+		return pContext->ThrowNativeError("DHookRegister %d is not supported in MidHook.Watch()", reg);
+	}
+	return 0;
+}
+
+static cell_t Native_MidHook_Unwatch(IPluginContext *pContext, const cell_t *params)
+{
+	Handle_t hndl = (Handle_t)params[1];
+	MidHook *hook;
+	HandleSecurity sec(pContext->GetIdentity(), myself->GetIdentity());
+	HandleError err = handlesys->ReadHandle(hndl, g_MidHookType, &sec, (void **)&hook);
+	if (err != HandleError_None)
+	{
+		return pContext->ThrowNativeError("Invalid Handle %x (error %d)", hndl, err);
+	}
+
+	hook->Unwatch();
+	return 0;
+}
+
+static cell_t Native_MidHook_Aggregate(IPluginContext *pContext, const cell_t *params)
+{
+	Handle_t hndl = (Handle_t)params[1];
+	MidHook *hook;
+	HandleSecurity sec(pContext->GetIdentity(), myself->GetIdentity());
+	HandleError err = handlesys->ReadHandle(hndl, g_MidHookType, &sec, (void **)&hook);
+	if (err != HandleError_None)
+	{
+		return pContext->ThrowNativeError("Invalid Handle %x (error %d)", hndl, err);
+	}
+
+	DHookRegister reg = (DHookRegister)params[2];
+	bool deref = (bool)params[3];
+	int offset = (int)params[4];
+	int numbertype = (int)params[5];
+	int capacity = (int)params[6];
+	bool exact = (bool)params[7];
+	bool passthrough = (bool)params[8];
+
+	if (capacity <= 0 || capacity > ValueSketch::MAX_CAPACITY)
+	{
+		return pContext->ThrowNativeError("'capacity' parameter set to an improper value: %d (should be between 1 and %d inclusive)", capacity, ValueSketch::MAX_CAPACITY);
+	}
+
+	if (!hook->Aggregate(reg, deref, offset, numbertype, capacity, exact, passthrough))
+	{
+		return pContext->ThrowNativeError("DHookRegister %d is not supported in MidHook.Aggregate()", reg);
+	}
+	return 0;
+}
+
+static cell_t Native_MidHook_StopAggregating(IPluginContext *pContext, const cell_t *params)
+{
+	Handle_t hndl = (Handle_t)params[1];
+	MidHook *hook;
+	HandleSecurity sec(pContext->GetIdentity(), myself->GetIdentity());
+	HandleError err = handlesys->ReadHandle(hndl, g_MidHookType, &sec, (void **)&hook);
+	if (err != HandleError_None)
+	{
+		return pContext->ThrowNativeError("Invalid Handle %x (error %d)", hndl, err);
+	}
+
+	hook->StopAggregating();
+	return 0;
+}
+
+static cell_t Native_MidHook_ResetAggregate(IPluginContext *pContext, const cell_t *params)
+{
+	Handle_t hndl = (Handle_t)params[1];
+	MidHook *hook;
+	HandleSecurity sec(pContext->GetIdentity(), myself->GetIdentity());
+	HandleError err = handlesys->ReadHandle(hndl, g_MidHookType, &sec, (void **)&hook);
+	if (err != HandleError_None)
+	{
+		return pContext->ThrowNativeError("Invalid Handle %x (error %d)", hndl, err);
+	}
+
+	ValueSketch *sketch = hook->Sketch();
+	if (!sketch)
+	{
+		return pContext->ThrowNativeError("MidHook is not aggregating");
+	}
+
+	sketch->Reset();
+	return 0;
+}
+
+static cell_t Native_MidHook_GetTopValues(IPluginContext *pContext, const cell_t *params)
+{
+	Handle_t hndl = (Handle_t)params[1];
+	MidHook *hook;
+	HandleSecurity sec(pContext->GetIdentity(), myself->GetIdentity());
+	HandleError err = handlesys->ReadHandle(hndl, g_MidHookType, &sec, (void **)&hook);
+	if (err != HandleError_None)
+	{
+		return pContext->ThrowNativeError("Invalid Handle %x (error %d)", hndl, err);
+	}
+
+	ValueSketch *sketch = hook->Sketch();
+	if (!sketch)
+	{
+		return pContext->ThrowNativeError("MidHook is not aggregating");
+	}
+
+	cell_t *values;
+	cell_t *counts;
+	pContext->LocalToPhysAddr(params[2], &values);
+	pContext->LocalToPhysAddr(params[3], &counts);
+	int max = (int)params[4];
+
+	if (max <= 0)
+		return 0;
+
+	std::vector<ValueSketch::Entry> top(std::min(max, sketch->Size()));
+	int count = sketch->Top(top.data(), (int)top.size());
+	for (int i = 0; i < count; i++)
+	{
+		values[i] = top[i].value;
+		counts[i] = (cell_t)top[i].count;
+	}
+	return count;
+}
+
+static cell_t Native_MidHook_CollectStacks(IPluginContext *pContext, const cell_t *params)
+{
+	Handle_t hndl = (Handle_t)params[1];
+	MidHook *hook;
+	HandleSecurity sec(pContext->GetIdentity(), myself->GetIdentity());
+	HandleError err = handlesys->ReadHandle(hndl, g_MidHookType, &sec, (void **)&hook);
+	if (err != HandleError_None)
+	{
+		return pContext->ThrowNativeError("Invalid Handle %x (error %d)", hndl, err);
+	}
+
+	int depth = (int)params[2];
+	int capacity = (int)params[3];
+	bool entry = (bool)params[4];
+	bool passthrough = (bool)params[5];
+
+	if (depth <= 0 || depth > StackTable::MAX_DEPTH)
+	{
+		return pContext->ThrowNativeError("'depth' parameter set to an improper value: %d (should be between 1 and %d inclusive)", depth, StackTable::MAX_DEPTH);
+	}
+
+	if (capacity <= 0 || capacity > StackTable::MAX_CAPACITY)
+	{
+		return pContext->ThrowNativeError("'capacity' parameter set to an improper value: %d (should be between 1 and %d inclusive)", capacity, StackTable::MAX_CAPACITY);
+	}
+
+	hook->CollectStacks(depth, capacity, entry, passthrough);
+	return 0;
+}
+
+static cell_t Native_MidHook_StopCollectingStacks(IPluginContext *pContext, const cell_t *params)
+{
+	Handle_t hndl = (Handle_t)params[1];
+	MidHook *hook;
+	HandleSecurity sec(pContext->GetIdentity(), myself->GetIdentity());
+	HandleError err = handlesys->ReadHandle(hndl, g_MidHookType, &sec, (void **)&hook);
+	if (err != HandleError_None)
+	{
+		return pContext->ThrowNativeError("Invalid Handle %x (error %d)", hndl, err);
+	}
+
+	hook->StopCollectingStacks();
+	return 0;
+}
+
+static cell_t Native_MidHook_ResetStacks(IPluginContext *pContext, const cell_t *params)
+{
+	Handle_t hndl = (Handle_t)params[1];
+	MidHook *hook;
+	HandleSecurity sec(pContext->GetIdentity(), myself->GetIdentity());
+	HandleError err = handlesys->ReadHandle(hndl, g_MidHookType, &sec, (void **)&hook);
+	if (err != HandleError_None)
+	{
+		return pContext->ThrowNativeError("Invalid Handle %x (error %d)", hndl, err);
+	}
+
+	StackTable *stacks = hook->Stacks();
+	if (!stacks)
+	{
+		return pContext->ThrowNativeError("MidHook is not collecting stacks");
+	}
+
+	stacks->Reset();
+	return 0;
+}
+
+static cell_t Native_MidHook_GetStack(IPluginContext *pContext, const cell_t *params)
+{
+	Handle_t hndl = (Handle_t)params[1];
+	MidHook *hook;
+	HandleSecurity sec(pContext->GetIdentity(), myself->GetIdentity());
+	HandleError err = handlesys->ReadHandle(hndl, g_MidHookType, &sec, (void **)&hook);
+	if (err != HandleError_None)
+	{
+		return pContext->ThrowNativeError("Invalid Handle %x (error %d)", hndl, err);
+	}
+
+	StackTable *stacks = hook->Stacks();
+	if (!stacks)
+	{
+		return pContext->ThrowNativeError("MidHook is not collecting stacks");
+	}
+
+	int rank = (int)params[2];
+	if (rank < 0 || rank >= stacks->Size())
+		return false;
+
+	std::vector<const StackTable::Entry *> top(rank + 1);
+	stacks->Top(top.data(), rank + 1);
+	const StackTable::Entry *entry = top[rank];
+
+	cell_t *frames;
+	pContext->LocalToPhysAddr(params[3], &frames);
+	int maxframes = (int)params[4];
+	for (int i = 0; i < entry->depth && i < maxframes; i++)
+		frames[i] = (cell_t)entry->frames[i];
+
+	cell_t *depth;
+	pContext->LocalToPhysAddr(params[5], &depth);
+	*depth = entry->depth;
+
+	cell_t *count;
+	pContext->LocalToPhysAddr(params[6], &count);
+	*count = (cell_t)entry->count;
+	return true;
+}
+
+static cell_t Native_MidHook_Trace(IPluginContext *pContext, const cell_t *params)
+{
+	Handle_t hndl = (Handle_t)params[1];
+	MidHook *hook;
+	HandleSecurity sec(pContext->GetIdentity(), myself->GetIdentity());
+	HandleError err = handlesys->ReadHandle(hndl, g_MidHookType, &sec, (void **)&hook);
+	if (err != HandleError_None)
+	{
+		return pContext->ThrowNativeError("Invalid Handle %x (error %d)", hndl, err);
+	}
+
+	uint32_t regmask = (uint32_t)params[2];
+	DHookRegister memreg = (DHookRegister)params[3];
+	int memoffs = (int)params[4];
+	int memlen = (int)params[5];
+	bool passthrough = (bool)params[6];
+
+	if (regmask >= (1u << MidHookReg_GPRCount))
+	{
+		return pContext->ThrowNativeError("'regs' parameter set to an improper value: %x (only MidHookReg_EAX through MidHookReg_ESP can be traced)", regmask);
+	}
+
+	if (memlen < 0 || memlen > TRACE_MAX_MEMLEN)
+	{
+		return pContext->ThrowNativeError("'memlen' parameter set to an improper value: %d (should be between 0 and %d inclusive)", memlen, TRACE_MAX_MEMLEN);
+	}
+
+	char error[256];
+	if (!OpenTraceFile(error, sizeof(error)))
+	{
+		return pContext->ThrowNativeError("Could not open the trace file: %s", error);
+	}
+
+	if (!hook->Trace(regmask, memreg, memoffs, memlen, passthrough))
+	{
+		return pContext->ThrowNativeError("DHookRegister %d is not supported in MidHook.Trace()", memreg);
+	}
+	return 0;
+}
+
+static cell_t Native_MidHook_StopTracing(IPluginContext *pContext, const cell_t *params)
+{
+	Handle_t hndl = (Handle_t)params[1];
+	MidHook *hook;
+	HandleSecurity sec(pContext->GetIdentity(), myself->GetIdentity());
+	HandleError err = handlesys->ReadHandle(hndl, g_MidHookType, &sec, (void **)&hook);
+	if (err != HandleError_None)
+	{
+		return pContext->ThrowNativeError("Invalid Handle %x (error %d)", hndl, err);
+	}
+
+	hook->StopTracing();
+	return 0;
+}
+
+// stats is indexed by MidHookLatency
+static void FillLatency(cell_t *stats, const LatencyHistogram &latency)
+{
+	stats[MidHookLatency_Calls] = (cell_t)latency.Count();
+	stats[MidHookLatency_P50] = (cell_t)latency.Percentile(50.0);
+	stats[MidHookLatency_P99] = (cell_t)latency.Percentile(99.0);
+	stats[MidHookLatency_Max] = (cell_t)latency.Max();
+	stats[MidHookLatency_TotalLow] = (cell_t)(latency.Total() & 0xFFFFFFFF);
+	stats[MidHookLatency_TotalHigh] = (cell_t)(latency.Total() >> 32);
+}
+
+static cell_t Native_MidHook_GetLatency(IPluginContext *pContext, const cell_t *params)
+{
+	Handle_t hndl = (Handle_t)params[1];
+	MidHook *hook;
+	HandleSecurity sec(pContext->GetIdentity(), myself->GetIdentity());
+	HandleError err = handlesys->ReadHandle(hndl, g_MidHookType, &sec, (void **)&hook);
+	if (err != HandleError_None)
+	{
+		return pContext->ThrowNativeError("Invalid Handle %x (error %d)", hndl, err);
+	}
+
+	cell_t *stats;
+	pContext->LocalToPhysAddr(params[2], &stats);
+
+	LatencyHistogram empty;
+	FillLatency(stats, hook->Latency() ? *hook->Latency() : empty);
+	return 0;
+}
+
+static cell_t Native_MidHook_ResetStats(IPluginContext *pContext, const cell_t *params)
+{
+	Handle_t hndl = (Handle_t)params[1];
+	MidHook *hook;
+	HandleSecurity sec(pContext->GetIdentity(), myself->GetIdentity());
+	HandleError err = handlesys->ReadHandle(hndl, g_MidHookType, &sec, (void **)&hook);
+	if (err != HandleError_None)
+	{
+		return pContext->ThrowNativeError("Invalid Handle %x (error %d)", hndl, err);
+	}
+
+	hook->ResetStats();
+	return 0;
+}
+
+static cell_t Native_MidHook_Hits_Get(IPluginContext *pContext, const cell_t *params)
+{
+	Handle_t hndl = (Handle_t)params[1];
+	MidHook *hook;
+	HandleSecurity sec(pContext->GetIdentity(), myself->GetIdentity());
+	HandleError err = handlesys->ReadHandle(hndl, g_MidHookType, &sec, (void **)&hook);
+	if (err != HandleError_None)
+	{
+		return pContext->ThrowNativeError("Invalid Handle %x (error %d)", hndl, err);
+	}
+
+	return (cell_t)hook->Hits();
+}
+
+static cell_t Native_MidHooks_SetProfiling(IPluginContext *pContext, const cell_t *params)
+{
+	g_Profiling = (bool)params[1];
+	return 0;
+}
+
+static cell_t Native_MidHooks_IsProfiling(IPluginContext *pContext, const cell_t *params)
+{
+	return (cell_t)g_Profiling;
+}
+
+static cell_t Native_MidHook_Data_Get(IPluginContext *pContext, const cell_t *params)
+{
+	Handle_t hndl = (Handle_t)params[1];
+	MidHook *hook;
+	HandleSecurity sec(pContext->GetIdentity(), myself->GetIdentity());
+	HandleError err = handlesys->ReadHandle(hndl, g_MidHookType, &sec, (void **)&hook);
+	if (err != HandleError_None)
+	{
+		return pContext->ThrowNativeError("Invalid Handle %x (error %d)", hndl, err);
+	}
+
+	return hook->Data();
+}
+
+static cell_t Native_MidHook_Data_Set(IPluginContext *pContext, const cell_t *params)
+{
+	Handle_t hndl = (Handle_t)params[1];
+	MidHook *hook;
+	HandleSecurity sec(pContext->GetIdentity(), myself->GetIdentity());
+	HandleError err = handlesys->ReadHandle(hndl, g_MidHookType, &sec, (void **)&hook);
+	if (err != HandleError_None)
+	{
+		return pContext->ThrowNativeError("Invalid Handle %x (error %d)", hndl, err);
+	}
+
+	hook->SetData(params[2]);
+	return 0;
+}
+
+static cell_t Native_MidHook_SetBudget(IPluginContext *pContext, const cell_t *params)
+{
+	Handle_t hndl = (Handle_t)params[1];
+	MidHook *hook;
+	HandleSecurity sec(pContext->GetIdentity(), myself->GetIdentity());
+	HandleError err = handlesys->ReadHandle(hndl, g_MidHookType, &sec, (void **)&hook);
+	if (err != HandleError_None)
+	{
+		return pContext->ThrowNativeError("Invalid Handle %x (error %d)", hndl, err);
+	}
+
+	// The forward is the owner's, and goes away with it
+	if (pContext != hook->Owner())
+	{
+		return pContext->ThrowNativeError("Only the plugin that created a MidHook can set its budget");
+	}
+
+	int cycles = (int)params[2];
+	int period = (int)params[3];
+	int action = (int)params[4];
+	int samplerate = (int)params[5];
+
+	if (cycles <= 0)
+	{
+		return pContext->ThrowNativeError("'cycles' parameter set to an improper value: %d (should be positive)", cycles);
+	}
+
+	if (period != MidHookBudget_PerSecond && period != MidHookBudget_PerTick)
+	{
+		return pContext->ThrowNativeError("Invalid MidHookBudgetPeriod: %d", period);
+	}
+
+	if (action != MidHookBudget_Sample && action != MidHookBudget_Disable)
+	{
+		return pContext->ThrowNativeError("Invalid MidHookBudgetAction: %d", action);
+	}
+
+	if (action == MidHookBudget_Sample && samplerate < 2)
+	{
+		return pContext->ThrowNativeError("'samplerate' parameter set to an improper value: %d (should be 2 or more)", samplerate);
+	}
+
+	// Looked up now, the hook goes over budget in the middle of engine code
+	IPluginFunction *forward = pContext->GetRuntime()->GetFunctionByName("MidHook_OnBudgetExceeded");
+	hook->SetBudget((uint64_t)cycles, (MidHookBudgetPeriod)period, (MidHookBudgetAction)action, samplerate, hndl, forward);
+	return 0;
+}
+
+static cell_t Native_MidHook_ClearBudget(IPluginContext *pContext, const cell_t *params)
+{
+	Handle_t hndl = (Handle_t)params[1];
+	MidHook *hook;
+	HandleSecurity sec(pContext->GetIdentity(), myself->GetIdentity());
+	HandleError err = handlesys->ReadHandle(hndl, g_MidHookType, &sec, (void **)&hook);
+	if (err != HandleError_None)
+	{
+		return pContext->ThrowNativeError("Invalid Handle %x (error %d)", hndl, err);
+	}
+
+	hook->ClearBudget();
+	return 0;
+}
+
+static cell_t Native_MidHook_SampleRate_Get(IPluginContext *pContext, const cell_t *params)
+{
+	Handle_t hndl = (Handle_t)params[1];
+	MidHook *hook;
+	HandleSecurity sec(pContext->GetIdentity(), myself->GetIdentity());
+	HandleError err = handlesys->ReadHandle(hndl, g_MidHookType, &sec, (void **)&hook);
+	if (err != HandleError_None)
+	{
+		return pContext->ThrowNativeError("Invalid Handle %x (error %d)", hndl, err);
+	}
+
+	return hook->SampleRate();
+}
+
+static cell_t Native_MidHook_SampleRate_Set(IPluginContext *pContext, const cell_t *params)
+{
+	Handle_t hndl = (Handle_t)params[1];
+	MidHook *hook;
+	HandleSecurity sec(pContext->GetIdentity(), myself->GetIdentity());
+	HandleError err = handlesys->ReadHandle(hndl, g_MidHookType, &sec, (void **)&hook);
+	if (err != HandleError_None)
+	{
+		return pContext->ThrowNativeError("Invalid Handle %x (error %d)", hndl, err);
+	}
+
+	int rate = (int)params[2];
+	if (rate < 1)
+	{
+		return pContext->ThrowNativeError("'rate' parameter set to an improper value: %d (should be 1 or more)", rate);
+	}
+
+	hook->SetSampleRate(rate);
+	return 0;
+}
+
+static cell_t Native_MidHookSpan(IPluginContext *pContext, const cell_t *params)
+{
+	void *start = (void *)params[1];
+	void *stop = (void *)params[2];
+	bool enable = (bool)params[3];
+
+	if (start == stop)
+	{
+		return pContext->ThrowNativeError("A span can't start and stop at the same address (%p)", start);
+	}
+
+	HookSpan *span = HookSpan::Create(start, stop, pContext);
+	if (!span)
+	{
+		return pContext->ThrowNativeError("Too many spans, at most %d can exist at once", HookSpan::MAX_SPANS);
+	}
+
+	Handle_t hndl = handlesys->CreateHandle(g_MidHookSpanType, (void *)span, pContext->GetIdentity(), myself->GetIdentity(), NULL);
+	if (!hndl)
+	{
+		delete span;
+		return pContext->ThrowNativeError("Failed to create MidHookSpan handle");
+	}
+
+	char error[256];
+	if (enable && !span->Enable(error, sizeof(error)))
+	{
+		HandleSecurity sec(pContext->GetIdentity(), myself->GetIdentity());
+		handlesys->FreeHandle(hndl, &sec);
+		return pContext->ThrowNativeError("%s", error);
+	}
+
+	return hndl;
+}
+
+static cell_t Native_MidHookSpan_Enable(IPluginContext *pContext, const cell_t *params)
+{
+	Handle_t hndl = (Handle_t)params[1];
+	HookSpan *span;
+	HandleSecurity sec(pContext->GetIdentity(), myself->GetIdentity());
+	HandleError err = handlesys->ReadHandle(hndl, g_MidHookSpanType, &sec, (void **)&span);
+	if (err != HandleError_None)
+	{
+		return pContext->ThrowNativeError("Invalid Handle %x (error %d)", hndl, err);
+	}
+
+	if (span->Enabled())
+		return false;
+
+	char error[256];
+	if (!span->Enable(error, sizeof(error)))
+	{
+		return pContext->ThrowNativeError("%s", error);
+	}
+	return true;
+}
+
+static cell_t Native_MidHookSpan_Disable(IPluginContext *pContext, const cell_t *params)
+{
+	Handle_t hndl = (Handle_t)params[1];
+	HookSpan *span;
+	HandleSecurity sec(pContext->GetIdentity(), myself->GetIdentity());
+	HandleError err = handlesys->ReadHandle(hndl, g_MidHookSpanType, &sec, (void **)&span);
+	if (err != HandleError_None)
+	{
+		return pContext->ThrowNativeError("Invalid Handle %x (error %d)", hndl, err);
+	}
+
+	return (cell_t)span->Disable();
+}
+
+static cell_t Native_MidHookSpan_Enabled_Get(IPluginContext *pContext, const cell_t *params)
+{
+	Handle_t hndl = (Handle_t)params[1];
+	HookSpan *span;
+	HandleSecurity sec(pContext->GetIdentity(), myself->GetIdentity());
+	HandleError err = handlesys->ReadHandle(hndl, g_MidHookSpanType, &sec, (void **)&span);
+	if (err != HandleError_None)
+	{
+		return pContext->ThrowNativeError("Invalid Handle %x (error %d)", hndl, err);
+	}
+
+	return span->Enabled();
+}
+
+static cell_t Native_MidHookSpan_GetStats(IPluginContext *pContext, const cell_t *params)
+{
+	Handle_t hndl = (Handle_t)params[1];
+	HookSpan *span;
+	HandleSecurity sec(pContext->GetIdentity(), myself->GetIdentity());
+	HandleError err = handlesys->ReadHandle(hndl, g_MidHookSpanType, &sec, (void **)&span);
+	if (err != HandleError_None)
+	{
+		return pContext->ThrowNativeError("Invalid Handle %x (error %d)", hndl, err);
+	}
+
+	cell_t *stats;
+	pContext->LocalToPhysAddr(params[2], &stats);
+	FillLatency(stats, span->Stats());
+	return 0;
+}
+
+static cell_t Native_MidHookSpan_Reset(IPluginContext *pContext, const cell_t *params)
+{
+	Handle_t hndl = (Handle_t)params[1];
+	HookSpan *span;
+	HandleSecurity sec(pContext->GetIdentity(), myself->GetIdentity());
+	HandleError err = handlesys->ReadHandle(hndl, g_MidHookSpanType, &sec, (void **)&span);
+	if (err != HandleError_None)
+	{
+		return pContext->ThrowNativeError("Invalid Handle %x (error %d)", hndl, err);
+	}
+
+	span->Reset();
+	return 0;
+}
+
+static cell_t Native_MidHookCoverage(IPluginContext *pContext, const cell_t *params)
+{
+	void *function = (void *)params[1];
+	int maxbytes = (int)params[2];
+	bool enable = (bool)params[3];
+
+	if (maxbytes <= 0 || maxbytes > BlockCoverage::MAX_BYTES)
+	{
+		return pContext->ThrowNativeError("'maxbytes' parameter set to an improper value: %d (should be between 1 and %d inclusive)", maxbytes, BlockCoverage::MAX_BYTES);
+	}
+
+	char error[256];
+	BlockCoverage *coverage = BlockCoverage::Create(function, maxbytes, pContext, error, sizeof(error));
+	if (!coverage)
+	{
+		return pContext->ThrowNativeError("%s", error);
+	}
+
+	Handle_t hndl = handlesys->CreateHandle(g_MidHookCoverageType, (void *)coverage, pContext->GetIdentity(), myself->GetIdentity(), NULL);
+	if (!hndl)
+	{
+		delete coverage;
+		return pContext->ThrowNativeError("Failed to create MidHookCoverage handle");
+	}
+
+	if (enable && !coverage->Enable(error, sizeof(error)))
+	{
+		HandleSecurity sec(pContext->GetIdentity(), myself->GetIdentity());
+		handlesys->FreeHandle(hndl, &sec);
+		return pContext->ThrowNativeError("%s", error);
+	}
+
+	return hndl;
+}
+
+static cell_t Native_MidHookCoverage_Enable(IPluginContext *pContext, const cell_t *params)
+{
+	Handle_t hndl = (Handle_t)params[1];
+	BlockCoverage *coverage;
+	HandleSecurity sec(pContext->GetIdentity(), myself->GetIdentity());
+	HandleError err = handlesys->ReadHandle(hndl, g_MidHookCoverageType, &sec, (void **)&coverage);
+	if (err != HandleError_None)
+	{
+		return pContext->ThrowNativeError("Invalid Handle %x (error %d)", hndl, err);
+	}
+
+	if (coverage->Enabled())
+		return false;
+
+	char error[256];
+	if (!coverage->Enable(error, sizeof(error)))
+	{
+		return pContext->ThrowNativeError("%s", error);
+	}
+	return true;
+}
+
+static cell_t Native_MidHookCoverage_Disable(IPluginContext *pContext, const cell_t *params)
+{
+	Handle_t hndl = (Handle_t)params[1];
+	BlockCoverage *coverage;
+	HandleSecurity sec(pContext->GetIdentity(), myself->GetIdentity());
+	HandleError err = handlesys->ReadHandle(hndl, g_MidHookCoverageType, &sec, (void **)&coverage);
+	if (err != HandleError_None)
+	{
+		return pContext->ThrowNativeError("Invalid Handle %x (error %d)", hndl, err);
+	}
+
+	return (cell_t)coverage->Disable();
+}
+
+static cell_t Native_MidHookCoverage_Enabled_Get(IPluginContext *pContext, const cell_t *params)
+{
+	Handle_t hndl = (Handle_t)params[1];
+	BlockCoverage *coverage;
+	HandleSecurity sec(pContext->GetIdentity(), myself->GetIdentity());
+	HandleError err = handlesys->ReadHandle(hndl, g_MidHookCoverageType, &sec, (void **)&coverage);
+	if (err != HandleError_None)
+	{
+		return pContext->ThrowNativeError("Invalid Handle %x (error %d)", hndl, err);
+	}
+
+	return coverage->Enabled();
+}
+
+static cell_t Native_MidHookCoverage_BlockCount_Get(IPluginContext *pContext, const cell_t *params)
+{
+	Handle_t hndl = (Handle_t)params[1];
+	BlockCoverage *coverage;
+	HandleSecurity sec(pContext->GetIdentity(), myself->GetIdentity());
+	HandleError err = handlesys->ReadHandle(hndl, g_MidHookCoverageType, &sec, (void **)&coverage);
+	if (err != HandleError_None)
+	{
+		return pContext->ThrowNativeError("Invalid Handle %x (error %d)", hndl, err);
+	}
+
+	return (cell_t)coverage->Blocks().size();
+}
+
+static cell_t Native_MidHookCoverage_GetBlock(IPluginContext *pContext, const cell_t *params)
+{
+	Handle_t hndl = (Handle_t)params[1];
+	BlockCoverage *coverage;
+	HandleSecurity sec(pContext->GetIdentity(), myself->GetIdentity());
+	HandleError err = handlesys->ReadHandle(hndl, g_MidHookCoverageType, &sec, (void **)&coverage);
+	if (err != HandleError_None)
+	{
+		return pContext->ThrowNativeError("Invalid Handle %x (error %d)", hndl, err);
+	}
+
+	int index = (int)params[2];
+	const std::vector<BlockCoverage::Block> &blocks = coverage->Blocks();
+	if (index < 0 || index >= (int)blocks.size())
+	{
+		return pContext->ThrowNativeError("Block index %d is out of bounds (%d blocks)", index, (int)blocks.size());
+	}
+
+	const BlockCoverage::Block &block = blocks[index];
+
+	cell_t *start;
+	pContext->LocalToPhysAddr(params[3], &start);
+	*start = (cell_t)block.start;
+
+	cell_t *size;
+	pContext->LocalToPhysAddr(params[4], &size);
+	*size = block.size;
+
+	cell_t *hits;
+	pContext->LocalToPhysAddr(params[5], &hits);
+	uint64_t count = block.probe ? block.probe->Hits() : 0;
+	*hits = (cell_t)std::min<uint64_t>(count, 0x7FFFFFFF);
+
+	return block.probe != nullptr;
+}
+
+static cell_t Native_MidHookCoverage_Reset(IPluginContext *pContext, const cell_t *params)
+{
+	Handle_t hndl = (Handle_t)params[1];
+	BlockCoverage *coverage;
+	HandleSecurity sec(pContext->GetIdentity(), myself->GetIdentity());
+	HandleError err = handlesys->ReadHandle(hndl, g_MidHookCoverageType, &sec, (void **)&coverage);
+	if (err != HandleError_None)
+	{
+		return pContext->ThrowNativeError("Invalid Handle %x (error %d)", hndl, err);
+	}
+
+	coverage->Reset();
+	return 0;
+}
+
+static cell_t Native_MidHookRegisters_Get(IPluginContext *pContext, const cell_t *params)
+{
+	Handle_t hndl = (Handle_t)params[1];
+	MidHookRegisters *regs;
+	HandleSecurity sec(pContext->GetIdentity(), myself->GetIdentity());
+	HandleError err = handlesys->ReadHandle(hndl, g_MidHookRegistersType, &sec, (void **)&regs);
+	if (err != HandleError_None)
+	{
+		return pContext->ThrowNativeError("Invalid Handle %x (error %d)", hndl, err);
+	}
+
+	DHookRegister reg = (DHookRegister)params[2];
+	int numbertype = params[0] >= 3 ? (int)params[3] : NumberType_Int32;
+
+	cell_t result = 0;
+	bool success = regs->Get(reg, numbertype, &result);
+	if (!success)
+	{
+		return pContext->ThrowNativeError("DHookRegister %d is not supported in MidHookRegisters.Get()", reg);
+	}
+	return result;
+}
+
+static cell_t Native_MidHookRegisters_Set(IPluginContext *pContext, const cell_t *params)
+{
+	Handle_t hndl = (Handle_t)params[1];
+	MidHookRegisters *regs;
+	HandleSecurity sec(pContext->GetIdentity(), myself->GetIdentity());
+	HandleError err = handlesys->ReadHandle(hndl, g_MidHookRegistersType, &sec, (void **)&regs);
 	if (err != HandleError_None)
 	{
 		return pContext->ThrowNativeError("Invalid Handle %x (error %d)", hndl, err);
 	}
 
-	return (cell_t)hook->Enable();
+	DHookRegister reg = (DHookRegister)params[2];
+	cell_t val = params[3];
+	int numbertype = params[0] >= 4 ? (int)params[4] : NumberType_Int32;
+
+	bool success = regs->Set(reg, numbertype, val);
+	if (!success)
+	{
+		return pContext->ThrowNativeError("DHookRegister %d is not supported in MidHookRegisters.Set()", reg);
+	}
+
+	return 0;
 }
 
-static cell_t Native_MidHook_Disable(IPluginContext *pContext, const cell_t *params)
+static cell_t Native_MidHookRegisters_Load(IPluginContext *pContext, const cell_t *params)
 {
 	Handle_t hndl = (Handle_t)params[1];
-	MidHook *hook;
+	MidHookRegisters *regs;
 	HandleSecurity sec(pContext->GetIdentity(), myself->GetIdentity());
-	HandleError err = handlesys->ReadHandle(hndl, g_MidHookType, &sec, (void **)&hook);
+	HandleError err = handlesys->ReadHandle(hndl, g_MidHookRegistersType, &sec, (void **)&regs);
 	if (err != HandleError_None)
 	{
 		return pContext->ThrowNativeError("Invalid Handle %x (error %d)", hndl, err);
 	}
 
-	return (cell_t)hook->Disable();
+	DHookRegister reg = (DHookRegister)params[2];
+	int offset = (int)params[3];
+	int numbertype = params[0] >= 4 ? (int)params[4] : NumberType_Int32;
+
+	cell_t result;
+	bool success = regs->Load(reg, offset, numbertype, &result);
+	if (!success)
+	{
+		return pContext->ThrowNativeError("DHookRegister %d is not supported in MidHookRegisters.Load()", reg);
+	}
+
+	return result;
 }
 
-static cell_t Native_MidHook_Enabled_Get(IPluginContext *pContext, const cell_t *params)
+static cell_t Native_MidHookRegisters_Store(IPluginContext *pContext, const cell_t *params)
 {
 	Handle_t hndl = (Handle_t)params[1];
-	MidHook *hook;
+	MidHookRegisters *regs;
 	HandleSecurity sec(pContext->GetIdentity(), myself->GetIdentity());
-	HandleError err = handlesys->ReadHandle(hndl, g_MidHookType, &sec, (void **)&hook);
+	HandleError err = handlesys->ReadHandle(hndl, g_MidHookRegistersType, &sec, (void **)&regs);
 	if (err != HandleError_None)
 	{
 		return pContext->ThrowNativeError("Invalid Handle %x (error %d)", hndl, err);
 	}
 
-	return (cell_t)hook->Enabled();
+	DHookRegister reg = (DHookRegister)params[2];
+	cell_t val = params[3];
+	int offset = (int)params[4];
+	int numbertype = params[0] >= 5 ? (int)params[5] : NumberType_Int32;
+
+	bool success = regs->Store(reg, offset, numbertype, val);
+	if (!success)
+	{
+		return pContext->ThrowNativeError("DHookRegister %d is not supported in MidHookRegisters.Store()", reg);
+	}
+	return 0;
 }
 
-static cell_t Native_MidHook_TargetAddress_Get(IPluginContext *pContext, const cell_t *params)
+static cell_t Native_MidHookRegisters_GetArgs(IPluginContext *pContext, const cell_t *params)
 {
 	Handle_t hndl = (Handle_t)params[1];
-	MidHook *hook;
+	MidHookRegisters *regs;
 	HandleSecurity sec(pContext->GetIdentity(), myself->GetIdentity());
-	HandleError err = handlesys->ReadHandle(hndl, g_MidHookType, &sec, (void **)&hook);
+	HandleError err = handlesys->ReadHandle(hndl, g_MidHookRegistersType, &sec, (void **)&regs);
 	if (err != HandleError_None)
 	{
 		return pContext->ThrowNativeError("Invalid Handle %x (error %d)", hndl, err);
 	}
 
-	return (cell_t)hook->Target();
+	int callconv = (int)params[2];
+	cell_t *array;
+	pContext->LocalToPhysAddr(params[3], &array);
+	int count = (int)params[4];
+
+	if (count < 0)
+	{
+		return pContext->ThrowNativeError("'count' parameter set to an improper value: %d", count);
+	}
+
+	bool success = regs->GetArgs(callconv, array, count);
+	if (!success)
+	{
+		return pContext->ThrowNativeError("CallingConvention %d is not supported in MidHookRegisters.GetArgs()", callconv);
+	}
+	return 0;
 }
 
-static cell_t Native_MidHook_ReturnAddress_Get(IPluginContext *pContext, const cell_t *params)
+static cell_t Native_MidHookRegisters_LoadArray(IPluginContext *pContext, const cell_t *params)
 {
 	Handle_t hndl = (Handle_t)params[1];
-	MidHook *hook;
+	MidHookRegisters *regs;
 	HandleSecurity sec(pContext->GetIdentity(), myself->GetIdentity());
-	HandleError err = handlesys->ReadHandle(hndl, g_MidHookType, &sec, (void **)&hook);
+	HandleError err = handlesys->ReadHandle(hndl, g_MidHookRegistersType, &sec, (void **)&regs);
 	if (err != HandleError_None)
 	{
 		return pContext->ThrowNativeError("Invalid Handle %x (error %d)", hndl, err);
 	}
 
-	return (cell_t)hook->ReturnAddress();
+	DHookRegister reg = (DHookRegister)params[2];
+	int offset = (int)params[3];
+	cell_t *array;
+	pContext->LocalToPhysAddr(params[4], &array);
+	int count = (int)params[5];
+	int numbertype = (int)params[6];
+
+	if (count < 0)
+	{
+		return pContext->ThrowNativeError("'count' parameter set to an improper value: %d", count);
+	}
+
+	bool success = regs->LoadArray(reg, offset, numbertype, array, count);
+	if (!success)
+	{
+		return pContext->ThrowNativeError("DHookRegister %d is not supported in MidHookRegisters.LoadArray()", reg);
+	}
+	return 0;
 }
 
-static cell_t Native_MidHookRegisters_Get(IPluginContext *pContext, const cell_t *params)
+static cell_t Native_MidHookRegisters_StoreArray(IPluginContext *pContext, const cell_t *params)
 {
 	Handle_t hndl = (Handle_t)params[1];
 	MidHookRegisters *regs;
@@ -104,18 +1075,26 @@ static cell_t Native_MidHookRegisters_Get(IPluginContext *pContext, const cell_t
 	}
 
 	DHookRegister reg = (DHookRegister)params[2];
-	int numbertype = params[0] >= 3 ? (int)params[3] : NumberType_Int32;
+	int offset = (int)params[3];
+	cell_t *array;
+	pContext->LocalToPhysAddr(params[4], &array);
+	int count = (int)params[5];
+	int numbertype = (int)params[6];
 
-	cell_t result = 0;
-	bool success = regs->Get(reg, numbertype, &result);
+	if (count < 0)
+	{
+		return pContext->ThrowNativeError("'count' parameter set to an improper value: %d", count);
+	}
+
+	bool success = regs->StoreArray(reg, offset, numbertype, array, count);
 	if (!success)
 	{
-		return pContext->ThrowNativeError("DHookRegister %d is not supported in MidHookRegisters.Get()", reg);
+		return pContext->ThrowNativeError("DHookRegister %d is not supported in MidHookRegisters.StoreArray()", reg);
 	}
-	return result;
+	return 0;
 }
 
-static cell_t Native_MidHookRegisters_Set(IPluginContext *pContext, const cell_t *params)
+static cell_t Native_MidHookRegisters_LoadString(IPluginContext *pContext, const cell_t *params)
 {
 	Handle_t hndl = (Handle_t)params[1];
 	MidHookRegisters *regs;
@@ -127,19 +1106,32 @@ static cell_t Native_MidHookRegisters_Set(IPluginContext *pContext, const cell_t
 	}
 
 	DHookRegister reg = (DHookRegister)params[2];
-	cell_t val = params[3];
-	int numbertype = params[0] >= 4 ? (int)params[4] : NumberType_Int32;
+	int offset = (int)params[3];
+	int maxlen = (int)params[5];
 
-	bool success = regs->Set(reg, numbertype, val);
+	if (maxlen <= 0)
+	{
+		return pContext->ThrowNativeError("'maxlen' parameter set to an improper value: %d", maxlen);
+	}
+
+	void *src;
+	bool success = regs->Address(reg, offset, &src);
 	if (!success)
 	{
-		return pContext->ThrowNativeError("DHookRegister %d is not supported in MidHookRegisters.Set()", reg);
+		return pContext->ThrowNativeError("DHookRegister %d is not supported in MidHookRegisters.LoadString()", reg);
 	}
 
-	return 0;
+	// Straight into the plugin's buffer, never reading past maxlen - 1 bytes
+	// of a string that isn't terminated in time
+	char *dest;
+	pContext->LocalToString(params[4], &dest);
+	strncpy(dest, (const char *)src, (size_t)maxlen - 1);
+	dest[maxlen - 1] = '\0';
+	return (cell_t)strlen(dest);
 }
 
-static cell_t Native_MidHookRegisters_Load(IPluginContext *pContext, const cell_t *params)
+// LoadChain and LoadChainFloat differ only in where nullSafe is and whether there's a numt
+static cell_t LoadChain(IPluginContext *pContext, const cell_t *params, int numbertype, bool nullsafe)
 {
 	Handle_t hndl = (Handle_t)params[1];
 	MidHookRegisters *regs;
@@ -151,20 +1143,37 @@ static cell_t Native_MidHookRegisters_Load(IPluginContext *pContext, const cell_
 	}
 
 	DHookRegister reg = (DHookRegister)params[2];
-	int offset = (int)params[3];
-	int numbertype = params[0] >= 4 ? (int)params[4] : NumberType_Int32;
+	cell_t *offsets;
+	pContext->LocalToPhysAddr(params[3], &offsets);
+	int count = (int)params[4];
+
+	if (count <= 0)
+	{
+		return pContext->ThrowNativeError("'count' parameter set to an improper value: %d (should be at least 1)", count);
+	}
 
 	cell_t result;
-	bool success = regs->Load(reg, offset, numbertype, &result);
+	bool success = regs->LoadChain(reg, offsets, count, numbertype, nullsafe, &result);
 	if (!success)
 	{
-		return pContext->ThrowNativeError("DHookRegister %d is not supported in MidHookRegisters.Load()", reg);
+		return pContext->ThrowNativeError("DHookRegister %d is not supported in MidHookRegisters.LoadChain()", reg);
 	}
 
 	return result;
 }
 
-static cell_t Native_MidHookRegisters_Store(IPluginContext *pContext, const cell_t *params)
+static cell_t Native_MidHookRegisters_LoadChain(IPluginContext *pContext, const cell_t *params)
+{
+	return LoadChain(pContext, params, (int)params[5], (bool)params[6]);
+}
+
+static cell_t Native_MidHookRegisters_LoadChainFloat(IPluginContext *pContext, const cell_t *params)
+{
+	return LoadChain(pContext, params, NumberType_Int32, (bool)params[5]);
+}
+
+// Same for StoreChain and StoreChainFloat
+static cell_t StoreChain(IPluginContext *pContext, const cell_t *params, int numbertype, bool nullsafe)
 {
 	Handle_t hndl = (Handle_t)params[1];
 	MidHookRegisters *regs;
@@ -176,16 +1185,34 @@ static cell_t Native_MidHookRegisters_Store(IPluginContext *pContext, const cell
 	}
 
 	DHookRegister reg = (DHookRegister)params[2];
-	cell_t val = params[3];
-	int offset = (int)params[4];
-	int numbertype = params[0] >= 5 ? (int)params[5] : NumberType_Int32;
+	cell_t *offsets;
+	pContext->LocalToPhysAddr(params[3], &offsets);
+	int count = (int)params[4];
+	cell_t val = params[5];
 
-	bool success = regs->Store(reg, offset, numbertype, val);
+	if (count <= 0)
+	{
+		return pContext->ThrowNativeError("'count' parameter set to an improper value: %d (should be at least 1)", count);
+	}
+
+	bool hit;
+	bool success = regs->StoreChain(reg, offsets, count, numbertype, nullsafe, val, &hit);
 	if (!success)
 	{
-		return pContext->ThrowNativeError("DHookRegister %d is not supported in MidHookRegisters.Store()", reg);
+		return pContext->ThrowNativeError("DHookRegister %d is not supported in MidHookRegisters.StoreChain()", reg);
 	}
-	return 0;
+
+	return (cell_t)hit;
+}
+
+static cell_t Native_MidHookRegisters_StoreChain(IPluginContext *pContext, const cell_t *params)
+{
+	return StoreChain(pContext, params, (int)params[6], (bool)params[7]);
+}
+
+static cell_t Native_MidHookRegisters_StoreChainFloat(IPluginContext *pContext, const cell_t *params)
+{
+	return StoreChain(pContext, params, NumberType_Int32, (bool)params[6]);
 }
 
 static cell_t Native_MidHookRegisters_GetXmmWord(IPluginContext *pContext, const cell_t *params)
@@ -252,6 +1279,166 @@ static cell_t Native_MidHookRegisters_SetXmmWord(IPluginContext *pContext, const
 	return 0;
 }
 
+static cell_t Native_MidHookRegisters_GetDouble(IPluginContext *pContext, const cell_t *params)
+{
+	Handle_t hndl = (Handle_t)params[1];
+	MidHookRegisters *regs;
+	HandleSecurity sec(pContext->GetIdentity(), myself->GetIdentity());
+	HandleError err = handlesys->ReadHandle(hndl, g_MidHookRegistersType, &sec, (void **)&regs);
+	if (err != HandleError_None)
+	{
+		return pContext->ThrowNativeError("Invalid Handle %x (error %d)", hndl, err);
+	}
+
+	DHookRegister reg = (DHookRegister)params[2];
+	int lane = (int)params[3];
+	if (lane < 0 || lane > 1)
+	{
+		return pContext->ThrowNativeError("'lane' parameter set to an improper value: %d (should be 0 or 1)", lane);
+	}
+
+	double result;
+	bool success = regs->GetDouble(reg, lane, &result);
+	if (!success)
+	{
+		return pContext->ThrowNativeError("DHookRegister %d is not supported in MidHookRegisters.GetDouble()", reg);
+	}
+
+	return sp_ftoc((float)result);
+}
+
+static cell_t Native_MidHookRegisters_SetDouble(IPluginContext *pContext, const cell_t *params)
+{
+	Handle_t hndl = (Handle_t)params[1];
+	MidHookRegisters *regs;
+	HandleSecurity sec(pContext->GetIdentity(), myself->GetIdentity());
+	HandleError err = handlesys->ReadHandle(hndl, g_MidHookRegistersType, &sec, (void **)&regs);
+	if (err != HandleError_None)
+	{
+		return pContext->ThrowNativeError("Invalid Handle %x (error %d)", hndl, err);
+	}
+
+	DHookRegister reg = (DHookRegister)params[2];
+	double val = (double)sp_ctof(params[3]);
+	int lane = (int)params[4];
+	if (lane < 0 || lane > 1)
+	{
+		return pContext->ThrowNativeError("'lane' parameter set to an improper value: %d (should be 0 or 1)", lane);
+	}
+
+	bool success = regs->SetDouble(reg, lane, val);
+	if (!success)
+	{
+		return pContext->ThrowNativeError("DHookRegister %d is not supported in MidHookRegisters.SetDouble()", reg);
+	}
+	return 0;
+}
+
+static cell_t Native_MidHookRegisters_LoadDouble(IPluginContext *pContext, const cell_t *params)
+{
+	Handle_t hndl = (Handle_t)params[1];
+	MidHookRegisters *regs;
+	HandleSecurity sec(pContext->GetIdentity(), myself->GetIdentity());
+	HandleError err = handlesys->ReadHandle(hndl, g_MidHookRegistersType, &sec, (void **)&regs);
+	if (err != HandleError_None)
+	{
+		return pContext->ThrowNativeError("Invalid Handle %x (error %d)", hndl, err);
+	}
+
+	DHookRegister reg = (DHookRegister)params[2];
+	int offset = (int)params[3];
+
+	void *src;
+	bool success = regs->Address(reg, offset, &src);
+	if (!success)
+	{
+		return pContext->ThrowNativeError("DHookRegister %d is not supported in MidHookRegisters.LoadDouble()", reg);
+	}
+
+	double result;
+	memcpy(&result, src, sizeof(double));
+	return sp_ftoc((float)result);
+}
+
+static cell_t Native_MidHookRegisters_StoreDouble(IPluginContext *pContext, const cell_t *params)
+{
+	Handle_t hndl = (Handle_t)params[1];
+	MidHookRegisters *regs;
+	HandleSecurity sec(pContext->GetIdentity(), myself->GetIdentity());
+	HandleError err = handlesys->ReadHandle(hndl, g_MidHookRegistersType, &sec, (void **)&regs);
+	if (err != HandleError_None)
+	{
+		return pContext->ThrowNativeError("Invalid Handle %x (error %d)", hndl, err);
+	}
+
+	DHookRegister reg = (DHookRegister)params[2];
+	double val = (double)sp_ctof(params[3]);
+	int offset = (int)params[4];
+
+	void *dest;
+	bool success = regs->Address(reg, offset, &dest);
+	if (!success)
+	{
+		return pContext->ThrowNativeError("DHookRegister %d is not supported in MidHookRegisters.StoreDouble()", reg);
+	}
+
+	memcpy(dest, &val, sizeof(double));
+	return 0;
+}
+
+static cell_t Native_MidHookRegisters_GetAll(IPluginContext *pContext, const cell_t *params)
+{
+	Handle_t hndl = (Handle_t)params[1];
+	MidHookRegisters *regs;
+	HandleSecurity sec(pContext->GetIdentity(), myself->GetIdentity());
+	HandleError err = handlesys->ReadHandle(hndl, g_MidHookRegistersType, &sec, (void **)&regs);
+	if (err != HandleError_None)
+	{
+		return pContext->ThrowNativeError("Invalid Handle %x (error %d)", hndl, err);
+	}
+
+	cell_t *array;
+	pContext->LocalToPhysAddr(params[2], &array);
+	int size = (int)params[3];
+	bool xmm = (bool)params[4];
+
+	int needed = xmm ? MidHookReg_Count : MidHookReg_GPRCount;
+	if (size < needed)
+	{
+		return pContext->ThrowNativeError("'size' parameter set to an improper value: %d (should be at least %d)", size, needed);
+	}
+
+	regs->GetAll(array, xmm);
+	return 0;
+}
+
+static cell_t Native_MidHookRegisters_SetAll(IPluginContext *pContext, const cell_t *params)
+{
+	Handle_t hndl = (Handle_t)params[1];
+	MidHookRegisters *regs;
+	HandleSecurity sec(pContext->GetIdentity(), myself->GetIdentity());
+	HandleError err = handlesys->ReadHandle(hndl, g_MidHookRegistersType, &sec, (void **)&regs);
+	if (err != HandleError_None)
+	{
+		return pContext->ThrowNativeError("Invalid Handle %x (error %d)", hndl, err);
+	}
+
+	cell_t *array;
+	pContext->LocalToPhysAddr(params[2], &array);
+	int size = (int)params[3];
+	int dirty = (int)params[4];
+	bool xmm = (bool)params[5];
+
+	int needed = xmm ? MidHookReg_Count : MidHookReg_GPRCount;
+	if (size < needed)
+	{
+		return pContext->ThrowNativeError("'size' parameter set to an improper value: %d (should be at least %d)", size, needed);
+	}
+
+	regs->SetAll(array, dirty, xmm);
+	return 0;
+}
+
 sp_nativeinfo_t g_Natives[] = {
 	{"MidHook.MidHook", Native_MidHook},
 	{"MidHook.Enable", Native_MidHook_Enable},
@@ -259,6 +1446,43 @@ sp_nativeinfo_t g_Natives[] = {
 	{"MidHook.Enabled.get", Native_MidHook_Enabled_Get},
 	{"MidHook.TargetAddress.get", Native_MidHook_TargetAddress_Get},
 	{"MidHook.ReturnAddress.get", Native_MidHook_ReturnAddress_Get},
+	{"MidHook.SetCallback", Native_MidHook_SetCallback},
+	{"MidHook.Watch", Native_MidHook_Watch},
+	{"MidHook.Unwatch", Native_MidHook_Unwatch},
+	{"MidHook.Aggregate", Native_MidHook_Aggregate},
+	{"MidHook.StopAggregating", Native_MidHook_StopAggregating},
+	{"MidHook.ResetAggregate", Native_MidHook_ResetAggregate},
+	{"MidHook.GetTopValues", Native_MidHook_GetTopValues},
+	{"MidHook.CollectStacks", Native_MidHook_CollectStacks},
+	{"MidHook.StopCollectingStacks", Native_MidHook_StopCollectingStacks},
+	{"MidHook.ResetStacks", Native_MidHook_ResetStacks},
+	{"MidHook.GetStack", Native_MidHook_GetStack},
+	{"MidHook.Trace", Native_MidHook_Trace},
+	{"MidHook.StopTracing", Native_MidHook_StopTracing},
+	{"MidHook.GetLatency", Native_MidHook_GetLatency},
+	{"MidHook.ResetStats", Native_MidHook_ResetStats},
+	{"MidHook.Hits.get", Native_MidHook_Hits_Get},
+	{"MidHook.Data.get", Native_MidHook_Data_Get},
+	{"MidHook.Data.set", Native_MidHook_Data_Set},
+	{"MidHook.SetBudget", Native_MidHook_SetBudget},
+	{"MidHook.ClearBudget", Native_MidHook_ClearBudget},
+	{"MidHook.SampleRate.get", Native_MidHook_SampleRate_Get},
+	{"MidHook.SampleRate.set", Native_MidHook_SampleRate_Set},
+
+	{"MidHookSpan.MidHookSpan", Native_MidHookSpan},
+	{"MidHookSpan.Enable", Native_MidHookSpan_Enable},
+	{"MidHookSpan.Disable", Native_MidHookSpan_Disable},
+	{"MidHookSpan.Enabled.get", Native_MidHookSpan_Enabled_Get},
+	{"MidHookSpan.GetStats", Native_MidHookSpan_GetStats},
+	{"MidHookSpan.Reset", Native_MidHookSpan_Reset},
+
+	{"MidHookCoverage.MidHookCoverage", Native_MidHookCoverage},
+	{"MidHookCoverage.Enable", Native_MidHookCoverage_Enable},
+	{"MidHookCoverage.Disable", Native_MidHookCoverage_Disable},
+	{"MidHookCoverage.Enabled.get", Native_MidHookCoverage_Enabled_Get},
+	{"MidHookCoverage.BlockCount.get", Native_MidHookCoverage_BlockCount_Get},
+	{"MidHookCoverage.GetBlock", Native_MidHookCoverage_GetBlock},
+	{"MidHookCoverage.Reset", Native_MidHookCoverage_Reset},
 
 	{"MidHookRegisters.Get", Native_MidHookRegisters_Get},
 	{"MidHookRegisters.GetFloat", Native_MidHookRegisters_Get},
@@ -268,7 +1492,24 @@ sp_nativeinfo_t g_Natives[] = {
 	{"MidHookRegisters.LoadFloat", Native_MidHookRegisters_Load},
 	{"MidHookRegisters.Store", Native_MidHookRegisters_Store},
 	{"MidHookRegisters.StoreFloat", Native_MidHookRegisters_Store},
+	{"MidHookRegisters.GetArgs", Native_MidHookRegisters_GetArgs},
+	{"MidHookRegisters.LoadArray", Native_MidHookRegisters_LoadArray},
+	{"MidHookRegisters.StoreArray", Native_MidHookRegisters_StoreArray},
+	{"MidHookRegisters.LoadString", Native_MidHookRegisters_LoadString},
+	{"MidHookRegisters.LoadChain", Native_MidHookRegisters_LoadChain},
+	{"MidHookRegisters.LoadChainFloat", Native_MidHookRegisters_LoadChainFloat},
+	{"MidHookRegisters.StoreChain", Native_MidHookRegisters_StoreChain},
+	{"MidHookRegisters.StoreChainFloat", Native_MidHookRegisters_StoreChainFloat},
 	{"MidHookRegisters.GetXmmWord", Native_MidHookRegisters_GetXmmWord},
 	{"MidHookRegisters.SetXmmWord", Native_MidHookRegisters_SetXmmWord},
+	{"MidHookRegisters.GetDouble", Native_MidHookRegisters_GetDouble},
+	{"MidHookRegisters.SetDouble", Native_MidHookRegisters_SetDouble},
+	{"MidHookRegisters.LoadDouble", Native_MidHookRegisters_LoadDouble},
+	{"MidHookRegisters.StoreDouble", Native_MidHookRegisters_StoreDouble},
+	{"MidHookRegisters.GetAll", Native_MidHookRegisters_GetAll},
+	{"MidHookRegisters.SetAll", Native_MidHookRegisters_SetAll},
+
+	{"MidHooks_SetProfiling", Native_MidHooks_SetProfiling},
+	{"MidHooks_IsProfiling", Native_MidHooks_IsProfiling},
 	{NULL, NULL}
 };
\ No newline at end of file
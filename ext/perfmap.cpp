@@ -0,0 +1,302 @@
+#include "perfmap.h"
+
+#if defined _LINUX
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <map>
+#include <string>
+#include <vector>
+
+// Everything we name starts with this, any other line in the map is someone else's
+static const char s_Prefix[] = "midhook_";
+
+struct PerfEntry
+{
+	size_t size;
+	std::string name;
+};
+
+static bool s_MapEnabled = false;
+static std::map<uintptr_t, PerfEntry> s_Entries;
+// Something was removed since the map was last written out
+static bool s_MapDirty = false;
+
+static int s_DumpFd = -1;
+// perf record only picks up the dump if it sees it mapped executable
+static void *s_DumpMarker = nullptr;
+static uint64_t s_CodeIndex = 0;
+
+// https://github.com/torvalds/linux/blob/master/tools/perf/Documentation/jitdump-specification.txt
+#pragma pack(push, 1)
+struct JitHeader
+{
+	uint32_t magic;
+	uint32_t version;
+	uint32_t total_size;
+	uint32_t elf_mach;
+	uint32_t pad1;
+	uint32_t pid;
+	uint64_t timestamp;
+	uint64_t flags;
+};
+
+struct JitRecordHeader
+{
+	uint32_t id;
+	uint32_t total_size;
+	uint64_t timestamp;
+};
+
+struct JitCodeLoad
+{
+	JitRecordHeader header;
+	uint32_t pid;
+	uint32_t tid;
+	uint64_t vma;
+	uint64_t code_addr;
+	uint64_t code_size;
+	uint64_t code_index;
+};
+#pragma pack(pop)
+
+static constexpr uint32_t JIT_MAGIC = 0x4A695444;
+static constexpr uint32_t JIT_CODE_LOAD = 0;
+static constexpr uint32_t JIT_CODE_CLOSE = 3;
+static constexpr uint32_t EM_386 = 3;
+
+// perf matches these up against its own clock
+static uint64_t MonotonicNanos()
+{
+	timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+static void WriteAll(int fd, const void *data, size_t size)
+{
+	const uint8_t *p = (const uint8_t *)data;
+	while (size)
+	{
+		ssize_t written = write(fd, p, size);
+		if (written <= 0)
+			return;
+
+		p += written;
+		size -= (size_t)written;
+	}
+}
+
+static void MapPath(char *buffer, size_t maxlen)
+{
+	snprintf(buffer, maxlen, "/tmp/perf-%d.map", (int)getpid());
+}
+
+static void AppendMapLine(FILE *fp, uintptr_t code, const PerfEntry &entry)
+{
+	fprintf(fp, "%x %x %s\n", (unsigned)code, (unsigned)entry.size, entry.name.c_str());
+}
+
+// There's no removing a line from a perf map, so it's written out again
+// In place, rather than renamed over, so anyone else appending to it keeps
+// appending to the same file
+static void RewriteMap()
+{
+	char path[64];
+	MapPath(path, sizeof(path));
+
+	std::vector<std::string> foreign;
+	if (FILE *fp = fopen(path, "r"))
+	{
+		char line[512];
+		while (fgets(line, sizeof(line), fp))
+		{
+			// start size name
+			const char *name = strchr(line, ' ');
+			name = name ? strchr(name + 1, ' ') : nullptr;
+			if (!name || strncmp(name + 1, s_Prefix, sizeof(s_Prefix) - 1))
+				foreign.push_back(line);
+		}
+		fclose(fp);
+	}
+
+	FILE *fp = fopen(path, "w");
+	if (!fp)
+		return;
+
+	for (const std::string &line : foreign)
+		fputs(line.c_str(), fp);
+	for (const auto &entry : s_Entries)
+		AppendMapLine(fp, entry.first, entry.second);
+	fclose(fp);
+}
+
+// Removals come in bursts (every rebuild frees a site's stubs), so they're
+// written out at most once a frame, off the path of whatever freed them
+static void OnGameFrame(bool simulating)
+{
+	if (!s_MapDirty)
+		return;
+
+	s_MapDirty = false;
+	RewriteMap();
+}
+
+static bool OpenJitDump(char *error, size_t maxlen)
+{
+	char path[64];
+	snprintf(path, sizeof(path), "/tmp/jit-%d.dump", (int)getpid());
+
+	s_DumpFd = open(path, O_CREAT | O_TRUNC | O_RDWR, 0666);
+	if (s_DumpFd == -1)
+	{
+		snprintf(error, maxlen, "open %s failed (%s)", path, strerror(errno));
+		return false;
+	}
+
+	s_DumpMarker = mmap(nullptr, sysconf(_SC_PAGESIZE), PROT_READ | PROT_EXEC, MAP_PRIVATE, s_DumpFd, 0);
+	if (s_DumpMarker == MAP_FAILED)
+	{
+		snprintf(error, maxlen, "mmap %s failed (%s)", path, strerror(errno));
+		s_DumpMarker = nullptr;
+		close(s_DumpFd);
+		s_DumpFd = -1;
+		return false;
+	}
+
+	JitHeader header = {};
+	header.magic = JIT_MAGIC;
+	header.version = 1;
+	header.total_size = sizeof(header);
+	header.elf_mach = EM_386;
+	header.pid = (uint32_t)getpid();
+	header.timestamp = MonotonicNanos();
+	WriteAll(s_DumpFd, &header, sizeof(header));
+	return true;
+}
+
+static void CloseJitDump()
+{
+	if (s_DumpFd == -1)
+		return;
+
+	JitRecordHeader record = {};
+	record.id = JIT_CODE_CLOSE;
+	record.total_size = sizeof(record);
+	record.timestamp = MonotonicNanos();
+	WriteAll(s_DumpFd, &record, sizeof(record));
+
+	munmap(s_DumpMarker, sysconf(_SC_PAGESIZE));
+	s_DumpMarker = nullptr;
+	close(s_DumpFd);
+	s_DumpFd = -1;
+}
+
+void CreatePerfMap()
+{
+	const char *mode = smutils->GetCoreConfigValue("MidHookPerfMap");
+	if (!mode)
+		return;
+
+	bool map = !strcmp(mode, "map") || !strcmp(mode, "both");
+	bool jitdump = !strcmp(mode, "jitdump") || !strcmp(mode, "both");
+	if (!map && !jitdump)
+	{
+		smutils->LogError(myself, "Unsupported MidHookPerfMap value \"%s\"", mode);
+		return;
+	}
+
+	s_MapEnabled = map;
+	if (map)
+		smutils->AddGameFrameHook(&OnGameFrame);
+
+	char error[256];
+	if (jitdump && !OpenJitDump(error, sizeof(error)))
+		smutils->LogError(myself, "Could not create jitdump file: %s", error);
+}
+
+void DestroyPerfMap()
+{
+	if (s_MapEnabled)
+	{
+		smutils->RemoveGameFrameHook(&OnGameFrame);
+		s_Entries.clear();
+		RewriteMap();
+		s_MapEnabled = false;
+		s_MapDirty = false;
+	}
+
+	CloseJitDump();
+}
+
+void PerfMapAdd(const void *code, size_t size, const char *name)
+{
+	if (s_MapEnabled)
+	{
+		PerfEntry &entry = s_Entries[(uintptr_t)code];
+		entry.size = size;
+		entry.name = name;
+
+		// Appending is enough until something is removed
+		char path[64];
+		MapPath(path, sizeof(path));
+		if (FILE *fp = fopen(path, "a"))
+		{
+			AppendMapLine(fp, (uintptr_t)code, entry);
+			fclose(fp);
+		}
+	}
+
+	if (s_DumpFd != -1)
+	{
+		size_t namelen = strlen(name) + 1;
+
+		JitCodeLoad record = {};
+		record.header.id = JIT_CODE_LOAD;
+		record.header.total_size = (uint32_t)(sizeof(record) + namelen + size);
+		record.header.timestamp = MonotonicNanos();
+		record.pid = (uint32_t)getpid();
+		record.tid = (uint32_t)syscall(SYS_gettid);
+		record.vma = (uintptr_t)code;
+		record.code_addr = (uintptr_t)code;
+		record.code_size = size;
+		record.code_index = s_CodeIndex++;
+
+		WriteAll(s_DumpFd, &record, sizeof(record));
+		WriteAll(s_DumpFd, name, namelen);
+		WriteAll(s_DumpFd, code, size);
+	}
+}
+
+void PerfMapRemove(const void *code)
+{
+	// jitdump has no unload record, perf goes by the load timestamps
+	if (s_MapEnabled && s_Entries.erase((uintptr_t)code))
+		s_MapDirty = true;
+}
+
+#else
+
+void CreatePerfMap()
+{
+}
+
+void DestroyPerfMap()
+{
+}
+
+void PerfMapAdd(const void *code, size_t size, const char *name)
+{
+}
+
+void PerfMapRemove(const void *code)
+{
+}
+
+#endif
@@ -0,0 +1,16 @@
+#pragma once
+
+#include "extension.h"
+
+// Names generated code for Linux profilers, picked by the "MidHookPerfMap" core.cfg key
+// "map" - /tmp/perf-<pid>.map, read by perf report
+// "jitdump" - /tmp/jit-<pid>.dump, for perf inject --jit, which also keeps the code bytes
+// "both" - Both of the above
+// Off if unset, and a no-op off of Linux
+void CreatePerfMap();
+void DestroyPerfMap();
+
+// code stays named until it's removed, or the extension unloads
+// Removals reach the perf map file by the end of the frame
+void PerfMapAdd(const void *code, size_t size, const char *name);
+void PerfMapRemove(const void *code);
@@ -0,0 +1,111 @@
+#include "profiler.h"
+#include "CDetour/detourhelpers.h"
+#include <string>
+#include <unordered_set>
+
+IProfilingTool *g_ProfilingTool = nullptr;
+
+// The vtable entry we replaced, and what was in it
+static void **s_Entry = nullptr;
+static void *s_Original = nullptr;
+
+// Node based, so the strings never move
+static std::unordered_set<std::string> s_ScopeNames;
+
+#if defined _MSC_VER
+// thiscall has this in ecx and pops its own arguments, fastcall with edx unused does the same
+typedef void (__fastcall *SetProfilingToolFn)(ISourcePawnEngine2 *, void *, IProfilingTool *);
+
+static void __fastcall SetProfilingTool(ISourcePawnEngine2 *self, void *, IProfilingTool *tool)
+{
+	g_ProfilingTool = tool;
+	((SetProfilingToolFn)s_Original)(self, nullptr, tool);
+}
+#else
+typedef void (*SetProfilingToolFn)(ISourcePawnEngine2 *, IProfilingTool *);
+
+static void SetProfilingTool(ISourcePawnEngine2 *self, IProfilingTool *tool)
+{
+	g_ProfilingTool = tool;
+	((SetProfilingToolFn)s_Original)(self, tool);
+}
+#endif
+
+// Where SetProfilingTool is in the vtable, or -1 if it can't be told
+static int VtableIndex()
+{
+	void (ISourcePawnEngine2::*method)(IProfilingTool *) = &ISourcePawnEngine2::SetProfilingTool;
+#if defined _MSC_VER
+	// Points at a thunk, mov eax, [ecx] then jmp [eax+disp]
+	uint8_t *code;
+	memcpy(&code, &method, sizeof(code));
+
+	// Incremental linking puts a jmp in front
+	if (code[0] == 0xE9)
+		code += 5 + *(int32_t *)(code + 1);
+
+	if (code[0] != 0x8B || code[1] != 0x01 || code[2] != 0xFF)
+		return -1;
+
+	switch (code[3])
+	{
+	case 0x20:
+		return 0;
+	case 0x60:
+		return code[4] / sizeof(void *);
+	case 0xA0:
+		return *(int32_t *)(code + 4) / sizeof(void *);
+	default:
+		return -1;
+	}
+#else
+	// Itanium ABI, a virtual is 1 + its offset into the vtable
+	struct
+	{
+		uintptr_t ptr;
+		ptrdiff_t adj;
+	} raw;
+	memcpy(&raw, &method, sizeof(raw));
+
+	if (!(raw.ptr & 1))
+		return -1;
+	return (int)((raw.ptr - 1) / sizeof(void *));
+#endif
+}
+
+void WatchProfilingTool()
+{
+	int index = VtableIndex();
+	if (index == -1)
+	{
+		smutils->LogError(myself, "Could not find SetProfilingTool, hooks won't show up in profiling tools");
+		return;
+	}
+
+	void **vtable = *(void ***)g_pSourcePawn2;
+	s_Entry = &vtable[index];
+	s_Original = *s_Entry;
+
+	SetMemPatchable(s_Entry, sizeof(void *));
+	*s_Entry = (void *)&SetProfilingTool;
+}
+
+void UnwatchProfilingTool()
+{
+	if (!s_Entry)
+		return;
+
+	// Whoever wrapped it after us would be left calling into nothing, either way
+	if (*s_Entry == (void *)&SetProfilingTool)
+		*s_Entry = s_Original;
+	else
+		smutils->LogError(myself, "SetProfilingTool was wrapped over by something else, leaving it in place");
+
+	s_Entry = nullptr;
+	g_ProfilingTool = nullptr;
+}
+
+const char *InternScopeName(const char *name)
+{
+	return s_ScopeNames.insert(name).first->c_str();
+}
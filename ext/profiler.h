@@ -0,0 +1,22 @@
+#pragma once
+
+#include "extension.h"
+
+// Hook callbacks as scopes in SourcePawn's profiling tools ("sm prof")
+// SourcePawn takes a tool but never says which it has, so the tool is picked up
+// by wrapping SetProfilingTool in ISourcePawnEngine2's vtable. A tool handed over
+// before we loaded isn't seen until the next "sm prof start"
+// nullptr until a tool is handed over, so without one the cost is this check
+extern IProfilingTool *g_ProfilingTool;
+
+void WatchProfilingTool();
+void UnwatchProfilingTool();
+
+// Tools may hold on to scope names, so these live as long as we do
+const char *InternScopeName(const char *name);
+
+// The tool, if it's profiling right now
+inline IProfilingTool *ActiveProfilingTool()
+{
+	return g_ProfilingTool && g_ProfilingTool->IsActive() ? g_ProfilingTool : nullptr;
+}
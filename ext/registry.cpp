@@ -0,0 +1,130 @@
+#include "registry.h"
+
+HookRegistry g_Registry;
+
+void HookRegistry::Add(MidHook *hook)
+{
+	Link(hook);
+	m_Count++;
+}
+
+void HookRegistry::Destroy(MidHook *hook)
+{
+	Unlink(hook);
+	m_Count--;
+	delete hook;
+}
+
+void HookRegistry::Link(MidHook *hook)
+{
+	MidHook **head = hook->m_Owner ? m_Plugins.Find((uintptr_t)hook->m_Owner) : &m_Released;
+	hook->m_PrevInPlugin = nullptr;
+	hook->m_NextInPlugin = head ? *head : nullptr;
+	if (hook->m_NextInPlugin)
+		hook->m_NextInPlugin->m_PrevInPlugin = hook;
+
+	if (hook->m_Owner)
+		m_Plugins.Insert((uintptr_t)hook->m_Owner, hook);
+	else
+		m_Released = hook;
+}
+
+void HookRegistry::Unlink(MidHook *hook)
+{
+	if (hook->m_PrevInPlugin)
+		hook->m_PrevInPlugin->m_NextInPlugin = hook->m_NextInPlugin;
+	else if (!hook->m_Owner)
+		m_Released = hook->m_NextInPlugin;
+	else if (hook->m_NextInPlugin)
+		m_Plugins.Insert((uintptr_t)hook->m_Owner, hook->m_NextInPlugin);
+	else
+		m_Plugins.Remove((uintptr_t)hook->m_Owner);
+
+	if (hook->m_NextInPlugin)
+		hook->m_NextInPlugin->m_PrevInPlugin = hook->m_PrevInPlugin;
+}
+
+void HookRegistry::Release(IPluginContext *owner)
+{
+	MidHook **head = m_Plugins.Find((uintptr_t)owner);
+	if (!head)
+		return;
+
+	// Unlinking the last one drops the plugin's key, so a context later
+	// allocated at the same address starts with an empty list
+	for (MidHook *hook = *head, *next; hook; hook = next)
+	{
+		next = hook->m_NextInPlugin;
+		Unlink(hook);
+		hook->Release();
+		Link(hook);
+	}
+}
+
+void HookRegistry::DestroyAll()
+{
+	ForEach([](MidHook *hook)
+	{
+		delete hook;
+	});
+	m_Plugins.Clear();
+	m_Released = nullptr;
+	m_Count = 0;
+}
+
+HookSite *HookRegistry::Attach(MidHook *hook, char *error, size_t maxlen)
+{
+	HookSite *site = FindSite(hook->Target());
+	if (!site)
+	{
+		site = HookSite::Create(hook->Target());
+
+		// The new window can't swallow the start of someone else's
+		for (int i = 1; i < site->ByteLen(); i++)
+		{
+			uint8_t *addr = (uint8_t *)hook->Target() + i;
+			if (m_Sites.Find((uintptr_t)addr))
+			{
+				snprintf(error, maxlen, "Hooking %p would overwrite the hook at %p", hook->Target(), addr);
+				delete site;
+				return nullptr;
+			}
+		}
+
+		m_Sites.Insert((uintptr_t)site->Target(), site);
+	}
+
+	if (!site->Attach(hook, error, maxlen))
+	{
+		// A brand new site that failed to build, or one that couldn't be
+		// rebuilt for the hooks it already had
+		if (site->Empty())
+		{
+			m_Sites.Remove((uintptr_t)site->Target());
+			delete site;
+		}
+		return nullptr;
+	}
+	return site;
+}
+
+void HookRegistry::Detach(MidHook *hook, HookSite *site)
+{
+	if (site->Detach(hook))
+	{
+		m_Sites.Remove((uintptr_t)site->Target());
+		delete site;
+	}
+}
+
+HookSite *HookRegistry::FindSite(const void *addr)
+{
+	// Windows are short, so check every start that could reach addr
+	for (int i = 0; i < HookSite::MAX_WINDOW; i++)
+	{
+		HookSite **site = m_Sites.Find((uintptr_t)addr - i);
+		if (site && (*site)->Contains(addr))
+			return *site;
+	}
+	return nullptr;
+}
@@ -0,0 +1,73 @@
+#pragma once
+
+#include "extension.h"
+#include "addressmap.h"
+#include "midhook.h"
+#include "hooksite.h"
+
+// Owns every MidHook
+// Hooks are indexed by owning plugin (an intrusive list per plugin) and,
+// while enabled, by the site they're attached to, so nothing has to scan
+// every hook in the process
+class HookRegistry
+{
+public:
+	// Takes ownership
+	void Add(MidHook *hook);
+	// Unlinks and deletes
+	void Destroy(MidHook *hook);
+	void DestroyAll();
+	// Unpatches everything a plugin owns and cuts the hooks loose from it
+	// Its hooks are deleted when their handles are freed, which may be later
+	// if they were cloned to another plugin, see MidHook::Release
+	void Release(IPluginContext *owner);
+
+	// Puts the hook on the site whose patch window holds its address,
+	// creating one if there is none
+	// Refuses addresses that land mid-instruction in an existing window,
+	// or whose own window would run over the start of another
+	HookSite *Attach(MidHook *hook, char *error, size_t maxlen);
+	void Detach(MidHook *hook, HookSite *site);
+
+	// Site whose patch window holds addr
+	HookSite *FindSite(const void *addr);
+
+	size_t Count() { return m_Count; }
+
+	// f(MidHook *)
+	template <typename F>
+	void ForEach(F f);
+
+private:
+	void Link(MidHook *hook);
+	void Unlink(MidHook *hook);
+
+	// Owning plugin context -> head of its list
+	AddressMap<MidHook *> m_Plugins;
+	// Hooks whose plugin has unloaded, kept alive by cloned handles
+	MidHook *m_Released = {};
+	// Window start -> site
+	AddressMap<HookSite *> m_Sites;
+	size_t m_Count = 0;
+};
+
+template <typename F>
+void HookRegistry::ForEach(F f)
+{
+	m_Plugins.ForEach([&f](uintptr_t, MidHook *head)
+	{
+		for (MidHook *hook = head, *next; hook; hook = next)
+		{
+			next = hook->m_NextInPlugin;
+			f(hook);
+		}
+	});
+
+	for (MidHook *hook = m_Released, *next; hook; hook = next)
+	{
+		next = hook->m_NextInPlugin;
+		f(hook);
+	}
+}
+
+extern HookRegistry g_Registry;
@@ -0,0 +1,154 @@
+#include "sketch.h"
+#include <algorithm>
+
+ValueSketch::ValueSketch(int capacity, bool exact)
+	: m_Capacity(capacity),
+	  m_Exact(exact)
+{
+	size_t size = 16;
+	while (size < (size_t)capacity * 2)
+		size <<= 1;
+
+	m_Entries.reserve(capacity);
+	m_Index.assign(size, EMPTY);
+	if (!exact)
+	{
+		m_Heap.reserve(capacity);
+		m_HeapPos.reserve(capacity);
+	}
+}
+
+size_t ValueSketch::Probe(cell_t value)
+{
+	size_t mask = m_Index.size() - 1;
+	for (size_t i = ((ucell_t)value * 0x9E3779B1u) & mask;; i = (i + 1) & mask)
+	{
+		if (m_Index[i] == EMPTY || m_Entries[m_Index[i]].value == value)
+			return i;
+	}
+}
+
+void ValueSketch::Unindex(cell_t value)
+{
+	size_t mask = m_Index.size() - 1;
+	size_t hole = Probe(value);
+	m_Index[hole] = EMPTY;
+
+	// Backward shift, so probes don't need tombstones
+	for (size_t i = (hole + 1) & mask; m_Index[i] != EMPTY; i = (i + 1) & mask)
+	{
+		size_t home = ((ucell_t)m_Entries[m_Index[i]].value * 0x9E3779B1u) & mask;
+		if (((i - home) & mask) >= ((i - hole) & mask))
+		{
+			m_Index[hole] = m_Index[i];
+			m_Index[i] = EMPTY;
+			hole = i;
+		}
+	}
+}
+
+void ValueSketch::HeapSwap(size_t a, size_t b)
+{
+	std::swap(m_Heap[a], m_Heap[b]);
+	m_HeapPos[m_Heap[a]] = (int32_t)a;
+	m_HeapPos[m_Heap[b]] = (int32_t)b;
+}
+
+void ValueSketch::SiftUp(size_t pos)
+{
+	while (pos > 0)
+	{
+		size_t parent = (pos - 1) / 2;
+		if (m_Entries[m_Heap[parent]].count <= m_Entries[m_Heap[pos]].count)
+			break;
+
+		HeapSwap(pos, parent);
+		pos = parent;
+	}
+}
+
+void ValueSketch::SiftDown(size_t pos)
+{
+	size_t size = m_Heap.size();
+	for (;;)
+	{
+		size_t min = pos;
+		size_t left = pos * 2 + 1;
+		size_t right = left + 1;
+		if (left < size && m_Entries[m_Heap[left]].count < m_Entries[m_Heap[min]].count)
+			min = left;
+		if (right < size && m_Entries[m_Heap[right]].count < m_Entries[m_Heap[min]].count)
+			min = right;
+		if (min == pos)
+			break;
+
+		HeapSwap(pos, min);
+		pos = min;
+	}
+}
+
+void ValueSketch::Add(cell_t value)
+{
+	m_Total++;
+
+	size_t slot = Probe(value);
+	if (m_Index[slot] != EMPTY)
+	{
+		int32_t index = m_Index[slot];
+		m_Entries[index].count++;
+		if (!m_Exact)
+			SiftDown(m_HeapPos[index]);
+		return;
+	}
+
+	if ((int)m_Entries.size() < m_Capacity)
+	{
+		int32_t index = (int32_t)m_Entries.size();
+		m_Index[slot] = index;
+		m_Entries.push_back({value, 1, 0});
+		if (!m_Exact)
+		{
+			m_Heap.push_back(index);
+			m_HeapPos.push_back((int32_t)m_Heap.size() - 1);
+			SiftUp(m_Heap.size() - 1);
+		}
+		return;
+	}
+
+	if (m_Exact)
+	{
+		m_Dropped++;
+		return;
+	}
+
+	// Evict the smallest
+	int32_t index = m_Heap[0];
+	Entry &min = m_Entries[index];
+
+	Unindex(min.value);
+	min.value = value;
+	min.error = min.count;
+	min.count++;
+	m_Index[Probe(value)] = index;
+	SiftDown(0);
+}
+
+void ValueSketch::Reset()
+{
+	m_Entries.clear();
+	m_Heap.clear();
+	m_HeapPos.clear();
+	std::fill(m_Index.begin(), m_Index.end(), EMPTY);
+	m_Total = 0;
+	m_Dropped = 0;
+}
+
+int ValueSketch::Top(Entry *out, int max)
+{
+	int count = std::min(max, (int)m_Entries.size());
+	std::partial_sort_copy(m_Entries.begin(), m_Entries.end(), out, out + count, [](const Entry &a, const Entry &b)
+	{
+		return a.count > b.count;
+	});
+	return count;
+}
@@ -0,0 +1,63 @@
+#pragma once
+
+#include "extension.h"
+#include <vector>
+
+// Counts the values seen at a hook without going through SourcePawn
+// Space-saving top-K: the table keeps the heaviest values it has seen, and when
+// a new value arrives with the table full it takes over the least counted entry,
+// inheriting its count. That inherited count is kept as the entry's error, the
+// most it can be overcounted by
+// The least counted entry is kept at the top of a min-heap, so finding it is
+// O(1) and a hit costs at most O(log capacity) to keep the heap in order
+// With exact, the table only ever holds real counts, and values that arrive once
+// it's full are counted as dropped instead
+class ValueSketch
+{
+public:
+	struct Entry
+	{
+		cell_t value;
+		uint32_t count;
+		uint32_t error;
+	};
+
+	static constexpr int MAX_CAPACITY = 4096;
+
+	ValueSketch(int capacity, bool exact);
+
+	void Add(cell_t value);
+	void Reset();
+
+	// Heaviest first, returns how many were written
+	int Top(Entry *out, int max);
+
+	int Size() { return (int)m_Entries.size(); }
+	int Capacity() { return m_Capacity; }
+	bool Exact() { return m_Exact; }
+	uint64_t Total() { return m_Total; }
+	uint64_t Dropped() { return m_Dropped; }
+
+private:
+	static constexpr int32_t EMPTY = -1;
+
+	// Slot in m_Index holding value, or the empty one it would go in
+	size_t Probe(cell_t value);
+	void Unindex(cell_t value);
+	// Move the entry at pos in m_Heap after its count changed
+	void SiftUp(size_t pos);
+	void SiftDown(size_t pos);
+	void HeapSwap(size_t a, size_t b);
+
+	int m_Capacity = {};
+	bool m_Exact = {};
+	uint64_t m_Total = {};
+	uint64_t m_Dropped = {};
+	std::vector<Entry> m_Entries;
+	// value -> index into m_Entries, open addressing, twice the capacity
+	std::vector<int32_t> m_Index;
+	// Indices into m_Entries, least counted first, and where each entry is in it
+	// Left empty with exact, which never evicts
+	std::vector<int32_t> m_Heap;
+	std::vector<int32_t> m_HeapPos;
+};
@@ -0,0 +1,123 @@
+#include "span.h"
+#include "midhook.h"
+#include "registry.h"
+#include "hooksite.h"
+
+#include <algorithm>
+
+std::vector<HookSpan *> HookSpan::s_Spans;
+HookSpan::Stamp HookSpan::s_Stamps[HookSpan::MAX_SPANS];
+uint32_t HookSpan::s_Generation = 0;
+
+HookSpan *HookSpan::Create(void *start, void *stop, IPluginContext *owner)
+{
+	auto free = std::find(s_Spans.begin(), s_Spans.end(), nullptr);
+	if (free == s_Spans.end())
+	{
+		if (s_Spans.size() >= MAX_SPANS)
+			return nullptr;
+
+		free = s_Spans.insert(s_Spans.end(), nullptr);
+	}
+
+	HookSpan *span = new HookSpan();
+	span->m_Slot = (int)(free - s_Spans.begin());
+	span->m_Generation = ++s_Generation;
+	*free = span;
+
+	span->m_Start = new MidHook(start, nullptr, owner, 0);
+	span->m_Start->SetSpan(span, false);
+	g_Registry.Add(span->m_Start);
+
+	span->m_Stop = new MidHook(stop, nullptr, owner, 0);
+	span->m_Stop->SetSpan(span, true);
+	g_Registry.Add(span->m_Stop);
+	return span;
+}
+
+HookSpan::~HookSpan()
+{
+	g_Registry.Destroy(m_Start);
+	g_Registry.Destroy(m_Stop);
+	s_Spans[m_Slot] = nullptr;
+}
+
+bool HookSpan::Enable(char *error, size_t maxlen)
+{
+	bool started = m_Start->Enabled();
+	if (!started && !m_Start->Enable(error, maxlen))
+		return false;
+
+	if (!m_Stop->Enabled() && !m_Stop->Enable(error, maxlen))
+	{
+		if (!started)
+			m_Start->Disable();
+		return false;
+	}
+	return true;
+}
+
+bool HookSpan::Disable()
+{
+	// Either end can be left disabled on its own, see HookSite::Orphan
+	bool start = m_Start->Disable();
+	bool stop = m_Stop->Disable();
+	return start || stop;
+}
+
+bool HookSpan::Enabled()
+{
+	return m_Start->Enabled() && m_Stop->Enabled();
+}
+
+const LatencyHistogram &HookSpan::Stats()
+{
+	LatencyHistogram *pending = m_Stop->Site() ? m_Stop->Site()->PendingTimings(m_Stop) : nullptr;
+	if (pending)
+		Fold(*pending);
+	return m_Stats;
+}
+
+void HookSpan::Reset()
+{
+	LatencyHistogram *pending = m_Stop->Site() ? m_Stop->Site()->PendingTimings(m_Stop) : nullptr;
+	if (pending)
+		pending->Reset();
+	m_Stats.Reset();
+}
+
+void HookSpan::Fold(LatencyHistogram &pending)
+{
+	m_Stats.Merge(pending);
+	pending.Reset();
+}
+
+uintptr_t HookSpan::ThreadSelf()
+{
+#if defined _MSC_VER
+	return (uintptr_t)__readfsdword(0x18);
+#else
+	uintptr_t self;
+	__asm__("movl %%gs:0, %0" : "=r"(self));
+	return self;
+#endif
+}
+
+// Keep in step with HookSite::EmitSpanEnd
+void HookSpan::OnStart()
+{
+	Stamp &start = s_Stamps[m_Slot];
+	start.tsc = Timestamp();
+	start.thread = ThreadSelf();
+	start.generation = m_Generation;
+}
+
+void HookSpan::OnStop()
+{
+	Stamp &start = s_Stamps[m_Slot];
+	if (start.thread != ThreadSelf() || start.generation != m_Generation)
+		return;
+
+	start.generation = 0;
+	m_Stats.Record(Timestamp() - start.tsc);
+}
@@ -0,0 +1,90 @@
+#pragma once
+
+#include "extension.h"
+#include "stats.h"
+#include <vector>
+
+class MidHook;
+
+// Times the code between two addresses, for profiling part of a function
+// Each end is a MidHook in the registry that never calls into SourcePawn: the
+// start one stamps the cycle counter and the thread into the span's Stamp, and
+// the stop one adds the time since into the span's histogram. Stops whose last
+// start was on another thread are ignored, and a start hit again before its
+// stop starts over
+// An end with its address to itself gets a bridge that does this in place,
+// see HookSite::EmitSpanEnd, otherwise it goes through the dispatcher
+// The time includes a bridge's worth of overhead, see "sm midhooks spans"
+class HookSpan
+{
+public:
+	// Spans are numbered into the stamps, so there's a limit
+	static constexpr int MAX_SPANS = 256;
+
+	// When the span last started, and on which thread
+	// These outlive the spans, so orphaned bridges always have somewhere to write
+	struct Stamp
+	{
+		uint64_t tsc;
+		// See ThreadSelf
+		uintptr_t thread;
+		// The span's, or 0 once a stop has used it
+		uint32_t generation;
+	};
+
+	// Returns nullptr if every slot is taken
+	static HookSpan *Create(void *start, void *stop, IPluginContext *owner);
+	~HookSpan();
+
+	// Both ends or neither, if this fails error is filled
+	bool Enable(char *error, size_t maxlen);
+	// Returns false if neither end was enabled
+	bool Disable();
+	bool Enabled();
+
+	int Id() { return m_Slot + 1; }
+	MidHook *Start() { return m_Start; }
+	MidHook *Stop() { return m_Stop; }
+	// Along with whatever the stop's bridge hasn't handed over yet
+	const LatencyHistogram &Stats();
+	void Reset();
+
+	// From the probes
+	void OnStart();
+	void OnStop();
+
+	// For the bridges
+	Stamp *LastStart() { return &s_Stamps[m_Slot]; }
+	uint32_t Generation() { return m_Generation; }
+	// Take over times recorded by the stop's bridge, and clear them there
+	void Fold(LatencyHistogram &pending);
+
+	// This thread's TEB or TCB, which points at itself, as read by the bridges
+	static uintptr_t ThreadSelf();
+
+	// f(HookSpan *)
+	template <typename F>
+	static void ForEach(F f)
+	{
+		for (HookSpan *span : s_Spans)
+		{
+			if (span)
+				f(span);
+		}
+	}
+
+private:
+	HookSpan() = default;
+
+	int m_Slot = {};
+	// Never 0, which marks a slot as stopped
+	uint32_t m_Generation = {};
+	MidHook *m_Start = {};
+	MidHook *m_Stop = {};
+	LatencyHistogram m_Stats;
+
+	// Indexed by slot
+	static std::vector<HookSpan *> s_Spans;
+	static Stamp s_Stamps[MAX_SPANS];
+	static uint32_t s_Generation;
+};
@@ -0,0 +1,151 @@
+#include "stacks.h"
+#include <algorithm>
+
+#if defined _LINUX
+#include <pthread.h>
+#else
+#include <intrin.h>
+#endif
+
+// The part of the current thread's stack a frame pointer can be in
+struct StackBounds
+{
+	bool known;
+	uintptr_t low;
+	uintptr_t high;
+};
+
+static const StackBounds &CurrentStack()
+{
+	static thread_local StackBounds bounds = {};
+	if (bounds.known)
+		return bounds;
+
+	bounds.known = true;
+#if defined _LINUX
+	pthread_attr_t attr;
+	if (!pthread_getattr_np(pthread_self(), &attr))
+	{
+		void *addr;
+		size_t size;
+		if (!pthread_attr_getstack(&attr, &addr, &size))
+		{
+			bounds.low = (uintptr_t)addr;
+			bounds.high = (uintptr_t)addr + size;
+		}
+		pthread_attr_destroy(&attr);
+	}
+#else
+	// NT_TIB StackBase and StackLimit
+	bounds.high = __readfsdword(0x04);
+	bounds.low = __readfsdword(0x08);
+#endif
+	return bounds;
+}
+
+StackTable::StackTable(int depth, int capacity, bool entry)
+	: m_Depth(depth),
+	  m_Capacity(capacity),
+	  m_Entry(entry)
+{
+	size_t size = 16;
+	while (size < (size_t)capacity * 2)
+		size <<= 1;
+
+	m_Index.assign(size, EMPTY);
+}
+
+size_t StackTable::Probe(uint64_t hash, const uintptr_t *frames, int depth)
+{
+	size_t mask = m_Index.size() - 1;
+	for (size_t i = (size_t)hash & mask;; i = (i + 1) & mask)
+	{
+		if (m_Index[i] == EMPTY)
+			return i;
+
+		const Entry &entry = m_Entries[m_Index[i]];
+		if (entry.hash == hash && entry.depth == depth && !memcmp(entry.frames, frames, depth * sizeof(uintptr_t)))
+			return i;
+	}
+}
+
+void StackTable::Add(uintptr_t esp, uintptr_t ebp)
+{
+	m_Total++;
+
+	const StackBounds &stack = CurrentStack();
+	uintptr_t frames[MAX_DEPTH];
+	int depth = 0;
+
+	if (m_Entry && depth < m_Depth && esp >= stack.low && esp + sizeof(uintptr_t) <= stack.high)
+		frames[depth++] = *(uintptr_t *)esp;
+
+	// Every frame has to be further up the stack than the last, which also
+	// keeps a corrupt chain from looping
+	uintptr_t floor = esp;
+	for (uintptr_t fp = ebp; depth < m_Depth;)
+	{
+		if ((fp & (sizeof(uintptr_t) - 1)) || fp < floor || fp < stack.low || fp + 2 * sizeof(uintptr_t) > stack.high)
+			break;
+
+		uintptr_t ra = ((uintptr_t *)fp)[1];
+		if (!ra)
+			break;
+
+		frames[depth++] = ra;
+		floor = fp + 2 * sizeof(uintptr_t);
+		fp = ((uintptr_t *)fp)[0];
+	}
+
+	// FNV-1a
+	uint64_t hash = 0xcbf29ce484222325ull;
+	for (int i = 0; i < depth; i++)
+		hash = (hash ^ frames[i]) * 0x100000001b3ull;
+
+	size_t slot = Probe(hash, frames, depth);
+	if (m_Index[slot] != EMPTY)
+	{
+		m_Entries[m_Index[slot]].count++;
+		return;
+	}
+
+	if ((int)m_Entries.size() >= m_Capacity)
+	{
+		m_Dropped++;
+		return;
+	}
+
+	m_Index[slot] = (int32_t)m_Entries.size();
+	m_Entries.emplace_back();
+
+	Entry &entry = m_Entries.back();
+	entry.hash = hash;
+	entry.count = 1;
+	entry.depth = depth;
+	memcpy(entry.frames, frames, depth * sizeof(uintptr_t));
+}
+
+void StackTable::Reset()
+{
+	m_Entries.clear();
+	std::fill(m_Index.begin(), m_Index.end(), EMPTY);
+	m_Total = 0;
+	m_Dropped = 0;
+}
+
+int StackTable::Top(const Entry **out, int max)
+{
+	std::vector<const Entry *> sorted;
+	sorted.reserve(m_Entries.size());
+	for (const Entry &entry : m_Entries)
+		sorted.push_back(&entry);
+
+	int count = std::min(max, (int)sorted.size());
+	std::partial_sort(sorted.begin(), sorted.begin() + count, sorted.end(), [](const Entry *a, const Entry *b)
+	{
+		return a->count > b->count;
+	});
+
+	std::copy(sorted.begin(), sorted.begin() + count, out);
+	return count;
+}
@@ -0,0 +1,55 @@
+#pragma once
+
+#include "extension.h"
+#include <vector>
+
+// Counts the distinct call stacks a hook is reached from, without going through
+// SourcePawn
+// Stacks are walked through the ebp chain, so frames of code built without frame
+// pointers are skipped over, and a walk stops as soon as a frame pointer leaves
+// the thread's stack or doesn't move up it. Counts are exact, stacks that arrive
+// once the table is full are counted as dropped
+class StackTable
+{
+public:
+	static constexpr int MAX_DEPTH = 32;
+	static constexpr int MAX_CAPACITY = 16384;
+
+	struct Entry
+	{
+		uint64_t hash;
+		uint32_t count;
+		int depth;
+		// Return addresses, innermost first
+		uintptr_t frames[MAX_DEPTH];
+	};
+
+	// With entry, the hook is on a function's first instruction, where ebp is
+	// still the caller's and the return address is at esp
+	StackTable(int depth, int capacity, bool entry);
+
+	void Add(uintptr_t esp, uintptr_t ebp);
+	void Reset();
+
+	// Most hit first, returns how many were written
+	int Top(const Entry **out, int max);
+
+	int Size() { return (int)m_Entries.size(); }
+	uint64_t Total() { return m_Total; }
+	uint64_t Dropped() { return m_Dropped; }
+
+private:
+	static constexpr int32_t EMPTY = -1;
+
+	// Slot in m_Index holding the stack, or the empty one it would go in
+	size_t Probe(uint64_t hash, const uintptr_t *frames, int depth);
+
+	int m_Depth = {};
+	int m_Capacity = {};
+	bool m_Entry = {};
+	uint64_t m_Total = {};
+	uint64_t m_Dropped = {};
+	std::vector<Entry> m_Entries;
+	// hash -> index into m_Entries, open addressing, twice the capacity
+	std::vector<int32_t> m_Index;
+};
@@ -0,0 +1,49 @@
+#include "stats.h"
+
+bool g_Profiling = false;
+
+uint64_t LatencyHistogram::BucketStart(int bucket)
+{
+	if (bucket < LINEAR)
+		return (uint64_t)bucket;
+
+	int exp = (bucket - LINEAR) / (1 << SUB_BITS) + (SUB_BITS + 2);
+	int sub = (bucket - LINEAR) % (1 << SUB_BITS);
+	return ((uint64_t)((1 << SUB_BITS) + sub)) << (exp - SUB_BITS);
+}
+
+void LatencyHistogram::Merge(const LatencyHistogram &other)
+{
+	for (int i = 0; i < NUM_BUCKETS; i++)
+		m_Buckets[i] += other.m_Buckets[i];
+
+	m_Count += other.m_Count;
+	m_Total += other.m_Total;
+	if (other.m_Max > m_Max)
+		m_Max = other.m_Max;
+}
+
+void LatencyHistogram::Reset()
+{
+	*this = LatencyHistogram();
+}
+
+uint64_t LatencyHistogram::Percentile(double p) const
+{
+	if (!m_Count)
+		return 0;
+
+	// Rank of the sample we're after, 1 based
+	uint64_t rank = (uint64_t)(p / 100.0 * (double)m_Count + 0.5);
+	if (rank < 1)
+		rank = 1;
+
+	uint64_t seen = 0;
+	for (int i = 0; i < NUM_BUCKETS; i++)
+	{
+		seen += m_Buckets[i];
+		if (seen >= rank)
+			return BucketStart(i);
+	}
+	return m_Max;
+}
@@ -0,0 +1,83 @@
+#pragma once
+
+#include "extension.h"
+
+#if defined _MSC_VER
+#include <intrin.h>
+#else
+#include <x86intrin.h>
+#endif
+
+// Whether hook dispatch is being timed, flipped at runtime
+// When off, the only cost is the check itself
+extern bool g_Profiling;
+
+inline uint64_t Timestamp()
+{
+	return __rdtsc();
+}
+
+// Cycle counts bucketed on a log scale, HDR style
+// Below 2^(SUB_BITS + 2) every value has its own bucket, above that each power
+// of two is split into 2^SUB_BITS linear buckets, so any recorded value is
+// within 25% of the bucket it lands in
+class LatencyHistogram
+{
+public:
+	static constexpr int SUB_BITS = 2;
+	static constexpr int LINEAR = 1 << (SUB_BITS + 2);
+	static constexpr int NUM_BUCKETS = LINEAR + (64 - (SUB_BITS + 2)) * (1 << SUB_BITS);
+
+	void Record(uint64_t cycles)
+	{
+		m_Buckets[Bucket(cycles)]++;
+		m_Count++;
+		m_Total += cycles;
+		if (cycles > m_Max)
+			m_Max = cycles;
+	}
+
+	void Merge(const LatencyHistogram &other);
+	void Reset();
+
+	// Lowest value of the bucket holding the p'th percentile (0-100)
+	uint64_t Percentile(double p) const;
+	uint64_t Count() const { return m_Count; }
+	uint64_t Total() const { return m_Total; }
+	uint64_t Max() const { return m_Max; }
+
+private:
+	// Span stop bridges record in place, see HookSite::EmitSpanEnd
+	friend class HookSite;
+
+	static int Bucket(uint64_t cycles)
+	{
+		if (cycles < LINEAR)
+			return (int)cycles;
+
+		int exp = Log2(cycles);
+		int sub = (int)(cycles >> (exp - SUB_BITS)) & ((1 << SUB_BITS) - 1);
+		return LINEAR + (exp - (SUB_BITS + 2)) * (1 << SUB_BITS) + sub;
+	}
+
+	static int Log2(uint64_t val)
+	{
+#if defined _MSC_VER
+		// No 64-bit scan on x86
+		unsigned long index;
+		if (_BitScanReverse(&index, (unsigned long)(val >> 32)))
+			return (int)index + 32;
+		_BitScanReverse(&index, (unsigned long)val);
+		return (int)index;
+#else
+		return 63 - __builtin_clzll(val);
+#endif
+	}
+
+	static uint64_t BucketStart(int bucket);
+
+	uint64_t m_Buckets[NUM_BUCKETS] = {};
+	uint64_t m_Count = {};
+	uint64_t m_Total = {};
+	uint64_t m_Max = {};
+};
@@ -0,0 +1,218 @@
+#include "trace.h"
+#include "stats.h"
+
+#if defined _LINUX
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <unistd.h>
+
+// Everything is little endian and packed, see tools/midhook_trace.py
+#pragma pack(push, 1)
+struct TraceHeader
+{
+	char magic[8];
+	uint32_t version;
+	uint32_t header_size;
+	// Size of the ring after the header
+	uint32_t capacity;
+	// Offsets into the ring, records live in [tail, head), wrapping
+	uint32_t head;
+	uint32_t tail;
+	uint32_t used;
+	uint64_t records;
+	// Records lost to the ring wrapping around
+	uint64_t overwritten;
+	// When the file was created, to put the timestamps in context
+	uint64_t start_tsc;
+	uint64_t start_time;
+};
+
+// Followed by a cell per bit of regmask, lowest first, then memlen bytes
+// If the memory couldn't be read, memlen is 0 and regmask has TRACE_MEM_FAULT set
+// A hookid of 0 or a size too small for this is padding up to the end of the ring
+struct TraceRecordHeader
+{
+	uint16_t size;
+	uint16_t memlen;
+	uint32_t hookid;
+	uint64_t tsc;
+	uint32_t regmask;
+};
+#pragma pack(pop)
+
+static_assert(sizeof(TraceHeader) == 64, "TraceHeader changed size");
+
+static const char s_Magic[8] = {'M', 'H', 'T', 'R', 'A', 'C', 'E', '\0'};
+static constexpr uint32_t TRACE_VERSION = 1;
+// Records and padding are kept 4 byte aligned
+static constexpr uint32_t TRACE_ALIGN = 4;
+// Past every register regmask can hold
+static constexpr uint32_t TRACE_MEM_FAULT = 1u << 31;
+
+static int s_TraceFd = -1;
+static size_t s_TraceSize = 0;
+static TraceHeader *s_Header = nullptr;
+static uint8_t *s_Ring = nullptr;
+
+bool OpenTraceFile(char *error, size_t maxlen)
+{
+	if (s_Header)
+		return true;
+
+	const char *file = smutils->GetCoreConfigValue("MidHookTraceFile");
+	char path[PLATFORM_MAX_PATH];
+	smutils->BuildPath(Path_SM, path, sizeof(path), "%s", file ? file : "logs/midhooks.trace");
+
+	const char *size = smutils->GetCoreConfigValue("MidHookTraceSize");
+	int megabytes = size ? atoi(size) : 16;
+	if (megabytes <= 0 || megabytes > 1024)
+	{
+		snprintf(error, maxlen, "MidHookTraceSize must be between 1 and 1024, got \"%s\"", size);
+		return false;
+	}
+
+	s_TraceFd = open(path, O_CREAT | O_TRUNC | O_RDWR, 0644);
+	if (s_TraceFd == -1)
+	{
+		snprintf(error, maxlen, "open %s failed (%s)", path, strerror(errno));
+		return false;
+	}
+
+	s_TraceSize = sizeof(TraceHeader) + (size_t)megabytes * 1024 * 1024;
+	void *map = MAP_FAILED;
+	if (ftruncate(s_TraceFd, s_TraceSize) == 0)
+		map = mmap(nullptr, s_TraceSize, PROT_READ | PROT_WRITE, MAP_SHARED, s_TraceFd, 0);
+
+	if (map == MAP_FAILED)
+	{
+		snprintf(error, maxlen, "mapping %s failed (%s)", path, strerror(errno));
+		close(s_TraceFd);
+		s_TraceFd = -1;
+		return false;
+	}
+
+	s_Header = (TraceHeader *)map;
+	s_Ring = (uint8_t *)map + sizeof(TraceHeader);
+
+	memcpy(s_Header->magic, s_Magic, sizeof(s_Magic));
+	s_Header->version = TRACE_VERSION;
+	s_Header->header_size = sizeof(TraceHeader);
+	s_Header->capacity = (uint32_t)(s_TraceSize - sizeof(TraceHeader));
+	s_Header->start_tsc = Timestamp();
+	s_Header->start_time = (uint64_t)time(nullptr);
+
+	smutils->LogMessage(myself, "Tracing to %s", path);
+	return true;
+}
+
+void CloseTraceFile()
+{
+	if (!s_Header)
+		return;
+
+	// Whatever is in the page cache makes it to the file on its own, this
+	// just means it's there by the time we're gone
+	msync(s_Header, s_TraceSize, MS_SYNC);
+	munmap(s_Header, s_TraceSize);
+	close(s_TraceFd);
+
+	s_Header = nullptr;
+	s_Ring = nullptr;
+	s_TraceFd = -1;
+}
+
+// Drops the oldest records until size bytes past head are free
+static void Reclaim(uint32_t size)
+{
+	while (s_Header->capacity - s_Header->used < size)
+	{
+		const TraceRecordHeader *oldest = (const TraceRecordHeader *)(s_Ring + s_Header->tail);
+		if (oldest->size >= sizeof(TraceRecordHeader) && oldest->hookid)
+			s_Header->overwritten++;
+
+		s_Header->tail = (s_Header->tail + oldest->size) % s_Header->capacity;
+		s_Header->used -= oldest->size;
+	}
+}
+
+// The traced register can hold anything, so read through the kernel, which
+// fails where a memcpy would fault
+static bool SafeRead(void *dest, const void *src, size_t len)
+{
+	iovec local = {dest, len};
+	iovec remote = {(void *)src, len};
+	return process_vm_readv(getpid(), &local, 1, &remote, 1, 0) == (ssize_t)len;
+}
+
+void TraceRecord(int hookid, uint32_t regmask, const cell_t *regs, const void *mem, int memlen)
+{
+	if (!s_Header)
+		return;
+
+	uint32_t size = sizeof(TraceRecordHeader) + __builtin_popcount(regmask) * sizeof(cell_t) + memlen;
+	size = (size + TRACE_ALIGN - 1) & ~(TRACE_ALIGN - 1);
+
+	// Records don't wrap, the rest of the ring is skipped instead
+	uint32_t remaining = s_Header->capacity - s_Header->head;
+	if (size > remaining)
+	{
+		Reclaim(remaining);
+		TraceRecordHeader *padding = (TraceRecordHeader *)(s_Ring + s_Header->head);
+		padding->size = (uint16_t)remaining;
+		if (remaining >= offsetof(TraceRecordHeader, tsc))
+			padding->hookid = 0;
+
+		s_Header->used += remaining;
+		s_Header->head = 0;
+	}
+
+	Reclaim(size);
+
+	uint8_t *dest = s_Ring + s_Header->head;
+	TraceRecordHeader *record = (TraceRecordHeader *)dest;
+	record->size = (uint16_t)size;
+	record->memlen = (uint16_t)memlen;
+	record->hookid = (uint32_t)hookid;
+	record->tsc = Timestamp();
+	record->regmask = regmask;
+	dest += sizeof(TraceRecordHeader);
+
+	for (uint32_t mask = regmask; mask; mask &= mask - 1)
+	{
+		memcpy(dest, &regs[__builtin_ctz(mask)], sizeof(cell_t));
+		dest += sizeof(cell_t);
+	}
+
+	if (memlen && !SafeRead(dest, mem, memlen))
+	{
+		record->memlen = 0;
+		record->regmask |= TRACE_MEM_FAULT;
+	}
+
+	s_Header->head = (s_Header->head + size) % s_Header->capacity;
+	s_Header->used += size;
+	s_Header->records++;
+}
+
+#else
+
+bool OpenTraceFile(char *error, size_t maxlen)
+{
+	snprintf(error, maxlen, "Tracing is only supported on Linux");
+	return false;
+}
+
+void CloseTraceFile()
+{
+}
+
+void TraceRecord(int hookid, uint32_t regmask, const cell_t *regs, const void *mem, int memlen)
+{
+}
+
+#endif
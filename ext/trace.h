@@ -0,0 +1,21 @@
+#pragma once
+
+#include "extension.h"
+
+// Hook traces, appended to a memory-mapped ring file for tools/midhook_trace.py
+// The file is picked by the "MidHookTraceFile" core.cfg key (relative to the
+// SourceMod folder, logs/midhooks.trace by default) and sized by "MidHookTraceSize"
+// in megabytes (16 by default). Once full, the oldest records are overwritten
+// Linux only
+
+// Records never carry more than this many bytes of memory
+static constexpr int TRACE_MAX_MEMLEN = 256;
+
+// Creates the file on first use, then does nothing
+// If this fails, error is filled
+bool OpenTraceFile(char *error, size_t maxlen);
+void CloseTraceFile();
+
+// Appends regs[n] for every bit n of regmask, then memlen bytes of mem
+// A no-op if the file isn't open
+void TraceRecord(int hookid, uint32_t regmask, const cell_t *regs, const void *mem, int memlen);
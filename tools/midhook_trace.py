@@ -0,0 +1,106 @@
+# vim: set sts=2 ts=8 sw=2 tw=99 et ft=python:
+# Converts a trace file written by MidHook.Trace() to CSV or JSON
+# See ext/trace.cpp for the layout
+import argparse
+import json
+import struct
+import sys
+
+HEADER = struct.Struct('<8sIIIIIIQQQQ')
+RECORD = struct.Struct('<HHIQI')
+MAGIC = b'MHTRACE\0'
+VERSION = 1
+
+# Bit n of a record's regmask, matches MidHookReg
+REGISTERS = ['eax', 'ecx', 'edx', 'ebx', 'ebp', 'esi', 'edi', 'eflags', 'esp']
+# Set in regmask when the memory asked for couldn't be read
+MEM_FAULT = 1 << 31
+
+def read_trace(data):
+  (magic, version, header_size, capacity, head, tail, used,
+   records, overwritten, start_tsc, start_time) = HEADER.unpack_from(data, 0)
+  if magic != MAGIC:
+    raise ValueError('not a midhook trace file')
+  if version != VERSION:
+    raise ValueError('unsupported trace version {0}'.format(version))
+
+  info = {
+    'records': records,
+    'overwritten': overwritten,
+    'start_tsc': start_tsc,
+    'start_time': start_time,
+  }
+
+  ring = data[header_size:header_size + capacity]
+  entries = []
+  pos = tail
+  while used:
+    size = struct.unpack_from('<H', ring, pos)[0]
+    if size == 0 or size > used:
+      raise ValueError('corrupt record at offset {0}'.format(pos))
+
+    # Anything else is padding up to the end of the ring
+    if size >= RECORD.size:
+      size, memlen, hookid, tsc, regmask = RECORD.unpack_from(ring, pos)
+    if size >= RECORD.size and hookid:
+      offset = pos + RECORD.size
+      regs = {}
+      for bit, name in enumerate(REGISTERS):
+        if regmask & (1 << bit):
+          regs[name] = struct.unpack_from('<I', ring, offset)[0]
+          offset += 4
+      entries.append({
+        'tsc': tsc,
+        'hook': hookid,
+        'regs': regs,
+        'mem': None if regmask & MEM_FAULT else ring[offset:offset + memlen].hex(),
+      })
+
+    pos = (pos + size) % capacity
+    used -= size
+
+  return info, entries
+
+def write_csv(out, info, entries):
+  out.write(','.join(['tsc', 'cycles', 'hook'] + REGISTERS + ['mem']) + '\n')
+  for entry in entries:
+    row = [str(entry['tsc']), str(entry['tsc'] - info['start_tsc']), str(entry['hook'])]
+    row += ['0x{0:08x}'.format(entry['regs'][name]) if name in entry['regs'] else '' for name in REGISTERS]
+    row.append('unreadable' if entry['mem'] is None else entry['mem'])
+    out.write(','.join(row) + '\n')
+
+def write_json(out, info, entries):
+  info = dict(info)
+  info['entries'] = entries
+  json.dump(info, out, indent=2)
+  out.write('\n')
+
+def main():
+  parser = argparse.ArgumentParser(description='Convert a MidHook trace file to CSV or JSON, oldest record first.')
+  parser.add_argument('file', help='The trace file, addons/sourcemod/logs/midhooks.trace by default')
+  parser.add_argument('-f', '--format', choices=['csv', 'json'], default='csv')
+  parser.add_argument('-o', '--output', help='Where to write to, stdout if not given')
+  args = parser.parse_args()
+
+  with open(args.file, 'rb') as fp:
+    data = fp.read()
+
+  try:
+    info, entries = read_trace(data)
+  except (ValueError, struct.error) as e:
+    sys.stderr.write('{0}: {1}\n'.format(args.file, e))
+    return 1
+
+  out = open(args.output, 'w') if args.output else sys.stdout
+  try:
+    if args.format == 'csv':
+      write_csv(out, info, entries)
+    else:
+      write_json(out, info, entries)
+  finally:
+    if args.output:
+      out.close()
+  return 0
+
+if __name__ == '__main__':
+  sys.exit(main())